@@ -3,148 +3,2229 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define MB (1024 * 1024)
 
 #define KB (1024)
 
-// 4100 bytes per PCB struct, 100 processes can exist simultaneously
-// 4100 * 100 bytes < 1024 * 500 bytes < 500KB total used up
-#define start_index_page_tables ((RAM_SIZE - OS_MEM_SIZE) / PAGE_SIZE)
-#define end_index_page_tables ( ((RAM_SIZE - OS_MEM_SIZE) / PAGE_SIZE) + (((4108)*(100)) - 1) )
+// frame number of the first frame in PS_MEM, frames below this belong to OS_MEM
+#define FIRST_USABLE_FRAME (OS_MEM_SIZE / PAGE_SIZE)
+#define USABLE_FRAMES ((RAM_SIZE - OS_MEM_SIZE) / PAGE_SIZE)
+
+// OS_MEM layout:
+//   frame bitmap and its summary      FRAME_BITMAP_AREA bytes
+//   buddy allocator metadata          struct buddy_area
+//   free PCB slot stack               struct pcb_free_stack, max_procs entries
+//   hot process metadata              one cache line aligned array per field, max_procs entries each
+//   PCBs                              max_procs * sizeof(struct PCB), the cold part
+//   page table pool                   the rest of OS_MEM, second level page tables of the live processes
+// the process table is sized by max_procs at os_init, idle PCB slots cost a few bytes each
+
+// free frame bitmap lives at the start of OS_MEM, one bit per usable frame (1 = allocated)
+// followed by a summary level with one bit per bitmap word (1 = word is full)
+// 1 GB of RAM -> 229376 usable frames -> 3584 words (28KB) of bitmap + 56 words of summary
+#define FRAME_BITMAP_WORDS (USABLE_FRAMES / 64)
+#define FRAME_SUMMARY_WORDS ((FRAME_BITMAP_WORDS + 63) / 64)
+#define frame_bitmap ((uint64_t*) &OS_MEM[0])
+#define frame_summary ((uint64_t*) &OS_MEM[FRAME_BITMAP_WORDS * sizeof(uint64_t)])
+// bytes reserved for bitmap and summary, rounded up to a page
+#define FRAME_BITMAP_AREA ((((FRAME_BITMAP_WORDS + FRAME_SUMMARY_WORDS) * sizeof(uint64_t)) + PAGE_SIZE - 1) & ~(long)(PAGE_SIZE - 1))
+
+// address of the first byte of a frame, frame numbers count from the start of RAM
+#define frame_to_mem(frame) (RAM + (long)(frame) * PAGE_SIZE)
+
+// second level tables of the two level page tables, their geometry (PT_LEAF_SHIFT) is in mmu.h
+#define PT_LEAF_ENTRIES (1 << PT_LEAF_SHIFT)
+#define PT_LEAF_SIZE (PT_LEAF_ENTRIES * sizeof(page_table_entry))
+#define PT_NO_LEAF (-1)
+
+// where translations live, set page_table_backend before os_init
+enum PAGE_TABLE_BACKEND {
+    PT_TWO_LEVEL,   // per-process page directory + second level tables, memory grows with processes
+    PT_HASHED       // one global table keyed by (slot, page), memory grows with physical frames
+};
+int page_table_backend = PT_TWO_LEVEL;
+
+// an entry of the hashed page table, free entries are linked through hash_next
+struct hashed_pte {
+    int slot;           // owning process, -1 if free
+    int page;
+    int hash_next;      // next entry in the bucket
+    int proc_next;      // entries of one process are doubly linked so that exit and fork need not search
+    int proc_prev;
+    page_table_entry pte;
+};
+
+// PCB of the given slot
+#define pcb_at(slot) (&pcb_table[slot])
+
+// a pid carries its PCB slot in the low bits and the slot's generation above them
+// the generation is bumped whenever the slot is released, so a stale pid never matches the slot's current pid
+#define PID_SLOT_BITS 16
+#define PID_SLOT_MASK ((1 << PID_SLOT_BITS) - 1)
+#define PID_MAX_GENERATION 0x7fff
+#define pid_to_slot(pid) ((pid) & PID_SLOT_MASK)
+
+// buddy allocator metadata follows the frame bitmap, see struct buddy_area
+#define start_index_buddy FRAME_BITMAP_AREA
+
+// largest buddy block is NUM_PAGES frames (1024 = 4MB), which is the whole virtual memory of a process
+#define BUDDY_MAX_ORDER (VA_BITS - PAGE_SHIFT)
+
+// PS_MEM is split into zones, e.g. one per simulated NUMA node or a low "DMA" zone
+// every zone has its own buddy free lists and statistics and covers its own range of the frame bitmap
+#define MAX_ZONES 8
+
+// where allocations go, see alloc_frame_run
+enum ZONE_POLICY {
+    ZONE_LOCAL_FIRST,   // the calling thread's zone, then the others in order
+    ZONE_INTERLEAVE     // rotate over all zones, at most ZONE_INTERLEAVE_FRAMES at a time
+};
+
+// 64 KB of a request goes to one zone before interleaving moves on to the next
+#define ZONE_INTERLEAVE_FRAMES 16
+
+struct frame_zone {
+    int first_frame;
+    int num_frames;
+    int free_frames;
+    int free_head[BUDDY_MAX_ORDER + 1];
+    int free_count[BUDDY_MAX_ORDER + 1];
+    // freed frames waiting to be zeroed, linked through buddy->next
+    int dirty_head;
+    int dirty_frames;
+    // statistics
+    long long frames_allocated;
+    long long frames_freed;
+    long long fallback_frames;   // frames handed out here because the preferred zone was full
+    long long frames_zeroed;
+};
+
+// free lists of the buddy allocator are linked through next/prev indexed by (frame - FIRST_USABLE_FRAME)
+// order[i] is the order of the free block starting at i, -1 if i is not the start of a free block
+// free_frames counts every free (and zeroed) frame, dirty_frames the freed ones still waiting to be zeroed,
+// zeroing_frames the ones taken off the dirty lists that are being zeroed without the pool lock held
+// reserved_frames the ones promised to requests that are in progress
+struct buddy_area {
+    int free_frames;
+    int dirty_frames;
+    int zeroing_frames;
+    int reserved_frames;
+    int num_zones;
+    int interleave_next;
+    struct frame_zone zones[MAX_ZONES];
+    int next[USABLE_FRAMES];
+    int prev[USABLE_FRAMES];
+    signed char order[USABLE_FRAMES];
+};
+#define buddy ((struct buddy_area*) &OS_MEM[start_index_buddy])
+
+// zone layout used by os_init, sizes are in frames and must be multiples of 1<<BUDDY_MAX_ORDER
+// leave zone_sizes all 0 to split PS_MEM evenly into num_zones zones
+int num_zones = 4;
+int zone_sizes[MAX_ZONES];
+int zone_policy = ZONE_LOCAL_FIRST;
+
+// zone of the simulated CPU the calling thread runs on
+__thread int current_zone;
+
+// stack of free PCB slots, follows the buddy allocator metadata
+struct pcb_free_stack {
+    int free_count;
+    int free_slots[];
+};
+#define start_index_pcb_slots (start_index_buddy + sizeof(struct buddy_area))
+#define pcb_slots ((struct pcb_free_stack*) &OS_MEM[start_index_pcb_slots])
+
+// stack of free second level tables in the page table pool
+struct page_table_free_stack {
+    int capacity;
+    int free_count;
+    int free_tables[];
+};
+
+// number of PCBs in the process table, set before os_init
+int max_procs = MAX_PROCS;
+
+// virtual memory layout of a process in pages, set by create_ps
+struct proc_segments {
+    int code_end;       // first page after code
+    int ro_data_end;    // first page after ro_data
+    int rw_data_end;    // first page after rw_data, the heap starts here
+    int stack_start;    // lowest stack page
+};
+
+// memory accesses of processes in flight in one address space (low bits) and the flag ksm_scan raises to hold
+// new ones back (MM_QUIESCE), in one word so that both sides order themselves with a single atomic operation.
+// One cache line per address space so that processes running on different threads do not share them
+#define MM_QUIESCE (1 << 30)
+struct mm_access {
+    int state;
+    char pad[60];
+};
+
+// placed in OS_MEM by os_init according to max_procs
+// hot per-process metadata, one dense array per field so that liveness checks, scans and statistics
+// touch a few cache lines for all processes and never the PCBs or page tables
+int* proc_pid;                          // pid of the process in the slot, ~(next pid) for a free slot
+unsigned char* proc_is_free;
+int* proc_rss;                          // resident pages
+struct proc_segments* proc_segments;
+int* proc_mm;                           // slot whose address space the process uses, its own unless it is a vfork child
+int* proc_lent;                         // vfork children borrowing the address space of the slot
+// cold part
+struct PCB* pcb_table;
+pthread_mutex_t* proc_mm_lock;          // held while the page table of the slot's address space changes, see mm_lock
+struct mm_access* proc_mm_access;       // memory accesses in flight in the slot's address space, see mm_access_begin
+struct page_table_free_stack* page_table_slots;
+unsigned short* page_table_used;        // present entries of each second level table
+page_table_entry* page_table_pool;
+// hashed page table, one entry per usable frame and a power of two number of buckets
+struct hashed_pte* hashed_ptes;
+int* hashed_buckets;
+int hashed_bucket_bits;
+int hashed_free_head;
+int hashed_free_count;
+int* proc_hashed_head;                  // first hashed entry of each process
+
+// one software TLB shared by all processes in front of read_mem/write_mem, tlb_sets sets of tlb_ways entries
+// entries are tagged with the address space ID (ASID) of their process, so switching pids needs no flush
+// tlb_sets must be a power of two, tlb_ways 1 makes it direct mapped, all three are set before os_init
+int tlb_sets = 64;
+int tlb_ways = 4;
+// ASIDs handed out per generation, running out starts a new generation and flushes the TLB
+int tlb_asids = 256;
+#define TLB_NO_PAGE (-1)
+// set in tlb_entry.flags once the dirty bit of the pte is known to be set, so a write hit needs no pte update
+#define TLB_DIRTY 8
+
+// a cached translation, the frame's address and its protection bits
+struct tlb_entry {
+    int asid;
+    int page;
+    int flags;
+    unsigned char* frame;
+};
+
+struct tlb_counters {
+    long long hits;
+    long long misses;
+    long long evictions;        // valid entries pushed out by a fill
+    long long rollovers;        // ASID generations used up
+    long long flushes;          // whole TLB flushes, rollovers and pid switches with use_asids 0
+};
+
+// placed in OS_MEM by os_init, tlb_sets * tlb_ways entries, most recently filled first within a set
+struct tlb_entry* tlb_entries;
+// one sequence number per set, also placed in OS_MEM. It is odd while a fill or invalidation holds the set,
+// hits read the set without locking and retry if the sequence number was odd or changed meanwhile
+unsigned* tlb_set_seq;
+int tlb_set_bits;
+struct tlb_counters tlb_counters;
+// generation in the upper 32 bits, ASID in the lower ones, a process whose generation is old gets a new ASID
+// on its next access, -1 for none
+long long* proc_asid;
+long long asid_generation;
+int asid_next;
+// 0 sends every access to the page table, for comparison
+int use_tlb = 1;
+// 0 makes the TLB untagged, it is flushed whenever the accessing process changes, for comparison
+int use_asids = 1;
+int tlb_last_asid;
+
+// 0 makes translate_batch use the scalar loop even when built with AVX2, for comparison. The AVX2 path is
+// only compiled in when __AVX2__ is defined, that is with -mavx2 (or -march=native on a machine that has
+// it); a plain build only has the scalar loop and use_simd changes nothing
+int use_simd = 1;
+// addresses translated per translate_batch call by read_mem_batch/write_mem_batch
+#define MEM_BATCH 256
+// 0 makes fork_ps copy every page right away instead of sharing them copy on write, for comparison
+int use_cow_fork = 1;
+
+// protects ASID assignment and whole TLB flushes, sets are locked through tlb_set_seq
+pthread_mutex_t tlb_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// references to every usable frame, one per mapping and one per pin, placed in OS_MEM by os_init
+// the frame goes back to the pool when the last one is dropped, see frame_put
+int* frame_refs;
+#define frame_ref(frame) (frame_refs[(frame) - FIRST_USABLE_FRAME])
+// how many of those references are pins taken by pin_mem, so that fork_ps can tell a pinned frame
+// from one that is merely shared
+int* frame_pins;
+#define frame_pin_count(frame) (frame_pins[(frame) - FIRST_USABLE_FRAME])
+
+// per-thread cache of free frames, see magazine_refill
+#define MAGAZINE_SIZE 64
+// frames moved between a magazine and the shared pool at a time
+#define MAGAZINE_BATCH 32
+// requests up to this many frames are served from the magazine, larger ones get contiguous runs from the buddy allocator
+#define MAGAZINE_MAX_REQUEST 16
+
+struct frame_magazine {
+    int count;
+    int frames[MAGAZINE_SIZE];
+};
+__thread struct frame_magazine magazine;
+__thread struct frame_magazine dirty_batch;
+// frames of the calling thread's magazine promised to its requests by reserve_frames
+__thread int magazine_reserved;
+
+// set to 0 to send every allocation and free straight to the shared pool
+int use_magazines = 1;
+
+// protects the frame bitmap, the zones and their buddy free lists and the frame counters
+pthread_mutex_t frame_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+// dirty frames taken off a dirty list and zeroed per pool lock release, see zone_zero_dirty
+#define ZERO_BATCH 16
+
+// signalled when frames go on a dirty list, wakes up the zeroing worker
+pthread_cond_t dirty_frames_cond = PTHREAD_COND_INITIALIZER;
+// broadcast when frames that were being zeroed reach the free lists
+pthread_cond_t zeroed_frames_cond = PTHREAD_COND_INITIALIZER;
+pthread_t zeroing_thread;
+int zeroing_worker_running = 0;
+
+// zeroing statistics, frames zeroed because an allocation found no clean frame and total time spent zeroing
+long long sync_zeroed_frames = 0;
+double zeroing_ns = 0;
+
+// copy on write statistics, pages copied on a write and pages taken over because no other process shared them anymore
+long long cow_copies = 0;
+long long cow_reuses = 0;
+
+// 0 makes create_ps allocate frames for rw_data and the stack right away instead of reserving the pages
+// and allocating each on its first access, for comparison
+int use_demand_paging = 1;
+// reserved pages that got their frame on first access
+long long demand_faults = 0;
+// 0 makes allocate_pages allocate a frame for every heap page right away instead of reserving the pages, for comparison
+int use_lazy_heap = 1;
+// the zero page, one page of zeros in OS_MEM placed by os_init. A read of a reserved page maps it read only
+// (copy on write if the page is writable) instead of allocating a frame. It is never freed and its
+// references are not counted, see frame_get
+int zero_frame;
+// reserved pages that were mapped to the zero page on a read
+long long zero_page_maps = 0;
+
+// protects claiming and releasing PCBs and second level tables
+pthread_mutex_t pcb_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// protects the buckets and free list of the hashed page table, lookups walk shared chains and take it too
+pthread_mutex_t hashed_pt_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// code + ro_data images loaded by create_ps, keyed by the source buffer and the segment sizes
+// the frames of an image are shared read only by every process created from the same bytes
+// the cache holds a reference to every frame of an image, evicted images live on in the processes mapping them
+#define IMAGE_CACHE_ENTRIES 16
+struct image_entry {
+    const unsigned char* src;   // NULL for a free entry
+    int code_pages;
+    int ro_pages;
+    uint64_t hash;              // image_hash of the contents, a lookup whose buffer hashes differently misses
+    long long last_used;
+    int frames[NUM_PAGES];
+};
+
+// placed in OS_MEM by os_init, IMAGE_CACHE_ENTRIES entries
+struct image_entry* image_cache;
+long long image_clock;
+long long image_hits;
+long long image_misses;
+// 0 makes create_ps copy code and ro_data into new frames for every process, for comparison
+int use_image_cache = 1;
+
+// protects the image cache, frame references are taken and dropped with it held
+pthread_mutex_t image_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// same page merging, see ksm_scan. Frames are found by a hash of their contents in an open addressing
+// table of KSM_TABLE_SIZE entries, stable entries are merged frames shared copy on write (the table holds a
+// reference to each), unstable ones are candidates seen once during the current pass
+#define KSM_TABLE_SIZE (1 << 16)
+enum KSM_ENTRY_STATE {
+    KSM_FREE,
+    KSM_UNSTABLE,
+    KSM_STABLE
+};
+
+struct ksm_entry {
+    uint64_t hash;
+    int frame;
+    int state;
+    int pid;            // owner of an unstable entry
+    int page;
+};
+
+struct ksm_counters {
+    long long pages_scanned;
+    long long pages_merged;     // page table entries pointed at a stable frame
+    long long full_scans;
+    double scan_ns;             // time spent in ksm_scan
+};
+
+// placed in OS_MEM by os_init
+struct ksm_entry* ksm_table;
+struct ksm_counters ksm_counters;
+// held by the thread running ksm_scan, it guards the table, the cursors and the counters
+pthread_mutex_t ksm_lock = PTHREAD_MUTEX_INITIALIZER;
+// where the next ksm_scan continues
+int ksm_cursor_slot;
+int ksm_cursor_page;
+// present pages seen since the current pass started, a pass that finds none ends ksm_scan
+int ksm_pass_pages;
 
 
 // last edited - 23/9/22
 
-// just a random array to be passed to ps_create
-unsigned char code_ro_data[10 * MB];
+// just a random array to be passed to ps_create
+unsigned char code_ro_data[10 * MB];
+
+// byte addressable memory, allocated by ram_init
+unsigned char* RAM;  
+
+
+// OS's memory starts at the beginning of RAM.
+// Store the process related info, page tables or other data structures here.
+// do not use more than (OS_MEM_SIZE: 128 MB).
+unsigned char* OS_MEM;  
+
+// memory that can be used by processes.   
+// (RAM_SIZE - OS_MEM_SIZE) bytes
+unsigned char* PS_MEM; 
+
+
+// This first frame has frame number 0 and is located at start of RAM(NOT PS_MEM).
+// We also include the OS_MEM even though it is not paged. This is 
+// because the RAM can only be accessed through physical RAM addresses.  
+// The OS should ensure that it does not map any of the frames, that correspond
+// to its memory, to any process's page. 
+int NUM_FRAMES = ((RAM_SIZE) / PAGE_SIZE);
+
+// Actual number of usable frames by the processes.
+int NUM_USABLE_FRAMES = ((RAM_SIZE - OS_MEM_SIZE) / PAGE_SIZE);
+
+// To be set in case of errors. 
+int error_no; 
+
+page_table_entry build_pte(int frame_num, int present, int flags);
+void buddy_init();
+struct frame_zone;
+int zone_zero_dirty(struct frame_zone* zone, int max_frames);
+struct frame_extent;
+void free_frames(struct frame_extent* extents, int count);
+
+void tlb_flush();
+int cow_break(int slot, int page);
+int page_fault(int slot, int page, int access);
+int handle_page_fault(int slot, int page, int access);
+void mm_lock(int slot);
+void mm_unlock(int slot);
+int fork_cow(int pid, int* pages, page_table_entry* ptes, int num_pages);
+int fork_copy(int pid, int* pages, page_table_entry* ptes, int num_pages);
+void translate_range(int slot, const int* vaddrs, int n, long* out_phys, int* out_status);
+int load_image(int slot, int code_size, int ro_data_size, int rw_data_size,
+               int max_stack_size, unsigned char* code_and_ro_data);
+int image_cache_shrink();
+
+// hand out bytes of OS_MEM starting at offset, on a cache line boundary
+void* os_mem_carve(long* offset, long bytes){
+    *offset = (*offset + 63) & ~63L;
+    void* res = &OS_MEM[*offset];
+    *offset += bytes;
+    return res;
+}
+
+// map RAM once, the host hands out zeroed pages on first touch so untouched RAM costs nothing
+void ram_init(){
+    if(RAM != NULL){
+        return;
+    }
+    void* mem = mmap(NULL, RAM_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mem == MAP_FAILED){
+        printf("Error : cannot allocate %ld bytes of RAM \n", (long)RAM_SIZE);
+        exit(1);
+    }
+    RAM = mem;
+    OS_MEM = RAM;
+    PS_MEM = RAM + OS_MEM_SIZE;
+}
+
+void os_init() {
+    // DONE student 
+    // initialize your data structures.
+    ram_init();
+
+    // the first FRAME_BITMAP_AREA bytes are reserved for the free frame bitmap and its summary
+    // intitalise them all to 0 since nothing has been allocated yet
+    // 0 means that the frame has not been allocated yet, 1 means frame allocated 
+    memset(frame_bitmap, 0, FRAME_BITMAP_WORDS * sizeof(uint64_t));
+    memset(frame_summary, 0, FRAME_SUMMARY_WORDS * sizeof(uint64_t));
+    // the free lists only hold zeroed frames, RAM starts out zeroed but a second os_init finds old data
+    static int initialized = 0;
+    if(initialized){
+        memset(PS_MEM, 0, RAM_SIZE - OS_MEM_SIZE);
+    }
+    initialized = 1;
+    buddy_init();
+    // frames cached by the calling thread belong to the old pool, they are all free again after buddy_init
+    magazine.count = 0;
+    dirty_batch.count = 0;
+    magazine_reserved = 0;
+    assert(max_procs >= 1 && max_procs <= (1 << PID_SLOT_BITS));
+    pcb_slots->free_count = 0;
+    for(int i=max_procs-1; i>=0; i--){
+        // pushed in reverse so that slot 0 is handed out first
+        pcb_slots->free_slots[pcb_slots->free_count++] = i;
+    }
+    // process table right after the slot stack, then the page table pool fills the rest of OS_MEM
+    long offset = start_index_pcb_slots + sizeof(struct pcb_free_stack) + max_procs * sizeof(int);
+    proc_pid = os_mem_carve(&offset, max_procs * sizeof(int));
+    proc_is_free = os_mem_carve(&offset, max_procs * sizeof(unsigned char));
+    proc_rss = os_mem_carve(&offset, max_procs * sizeof(int));
+    proc_segments = os_mem_carve(&offset, max_procs * sizeof(struct proc_segments));
+    proc_mm = os_mem_carve(&offset, max_procs * sizeof(int));
+    proc_lent = os_mem_carve(&offset, max_procs * sizeof(int));
+    pcb_table = os_mem_carve(&offset, max_procs * sizeof(struct PCB));
+    proc_mm_lock = os_mem_carve(&offset, max_procs * sizeof(pthread_mutex_t));
+    proc_mm_access = os_mem_carve(&offset, max_procs * sizeof(struct mm_access));
+    memset(proc_mm_access, 0, max_procs * sizeof(struct mm_access));
+    proc_hashed_head = os_mem_carve(&offset, max_procs * sizeof(int));
+    proc_asid = os_mem_carve(&offset, max_procs * sizeof(long long));
+    image_cache = os_mem_carve(&offset, IMAGE_CACHE_ENTRIES * sizeof(struct image_entry));
+    memset(image_cache, 0, IMAGE_CACHE_ENTRIES * sizeof(struct image_entry));
+    image_clock = 0;
+    image_hits = 0;
+    image_misses = 0;
+    ksm_table = os_mem_carve(&offset, KSM_TABLE_SIZE * sizeof(struct ksm_entry));
+    memset(ksm_table, 0, KSM_TABLE_SIZE * sizeof(struct ksm_entry));
+    memset(&ksm_counters, 0, sizeof(ksm_counters));
+    ksm_cursor_slot = 0;
+    ksm_cursor_page = 0;
+    ksm_pass_pages = 0;
+    frame_refs = os_mem_carve(&offset, USABLE_FRAMES * sizeof(int));
+    memset(frame_refs, 0, USABLE_FRAMES * sizeof(int));
+    frame_pins = os_mem_carve(&offset, USABLE_FRAMES * sizeof(int));
+    memset(frame_pins, 0, USABLE_FRAMES * sizeof(int));
+    assert(tlb_sets >= 1 && (tlb_sets & (tlb_sets - 1)) == 0 && tlb_ways >= 1 && tlb_asids >= 1);
+    tlb_entries = os_mem_carve(&offset, (long)tlb_sets * tlb_ways * sizeof(struct tlb_entry));
+    tlb_set_seq = os_mem_carve(&offset, tlb_sets * sizeof(unsigned));
+    memset(tlb_set_seq, 0, tlb_sets * sizeof(unsigned));
+    tlb_set_bits = __builtin_ctz(tlb_sets);
+    memset(&tlb_counters, 0, sizeof(tlb_counters));
+    tlb_flush();
+    asid_generation = 0;
+    asid_next = 0;
+    tlb_last_asid = -1;
+    if(page_table_backend == PT_HASHED){
+        // sized to the usable frames, buckets are the next power of two so that chains stay around one entry
+        hashed_bucket_bits = 0;
+        while((1 << hashed_bucket_bits) < USABLE_FRAMES){
+            hashed_bucket_bits++;
+        }
+        hashed_ptes = os_mem_carve(&offset, USABLE_FRAMES * sizeof(struct hashed_pte));
+        hashed_buckets = os_mem_carve(&offset, (1L << hashed_bucket_bits) * sizeof(int));
+        memset(hashed_buckets, 0xff, (1L << hashed_bucket_bits) * sizeof(int));
+        for(int i=0; i<USABLE_FRAMES; i++){
+            hashed_ptes[i].slot = -1;
+            hashed_ptes[i].hash_next = i + 1 < USABLE_FRAMES ? i + 1 : -1;
+        }
+        hashed_free_head = 0;
+        hashed_free_count = USABLE_FRAMES;
+    }
+    offset = (offset + PAGE_SIZE - 1) & ~(long)(PAGE_SIZE - 1);
+    zero_frame = offset / PAGE_SIZE;
+    memset(frame_to_mem(zero_frame), 0, PAGE_SIZE);
+    offset += PAGE_SIZE;
+    page_table_slots = (struct page_table_free_stack*) &OS_MEM[offset];
+    long pool_bytes = OS_MEM_SIZE - offset - sizeof(struct page_table_free_stack) - 2 * PAGE_SIZE;
+    int capacity = pool_bytes / (PT_LEAF_SIZE + sizeof(int) + sizeof(unsigned short));
+    page_table_slots->capacity = capacity;
+    offset += sizeof(struct page_table_free_stack) + capacity * sizeof(int);
+    page_table_used = os_mem_carve(&offset, capacity * sizeof(unsigned short));
+    offset = (offset + PAGE_SIZE - 1) & ~(long)(PAGE_SIZE - 1);
+    page_table_pool = (page_table_entry*) &OS_MEM[offset];
+    assert(offset + capacity * PT_LEAF_SIZE <= OS_MEM_SIZE);
+    page_table_slots->free_count = 0;
+    for(int i=page_table_slots->capacity-1; i>=0; i--){
+        page_table_slots->free_tables[page_table_slots->free_count++] = i;
+    }
+    // recursive, exit_ps and page_fault are also called from operations that hold the lock already
+    pthread_mutexattr_t mm_lock_attr;
+    pthread_mutexattr_init(&mm_lock_attr);
+    pthread_mutexattr_settype(&mm_lock_attr, PTHREAD_MUTEX_RECURSIVE);
+    for(int i=0; i<max_procs; i++){
+        pthread_mutex_init(&proc_mm_lock[i], &mm_lock_attr);
+        proc_pid[i] = ~i;
+        proc_is_free[i] = 1;
+        proc_rss[i] = 0;
+        proc_mm[i] = i;
+        proc_lent[i] = 0;
+        memset(pcb_at(i)->page_dir, 0xff, sizeof(pcb_at(i)->page_dir));
+        proc_hashed_head[i] = -1;
+        proc_asid[i] = -1;
+    }
+    pthread_mutexattr_destroy(&mm_lock_attr);
+}
+
+// mark frame as allocated in the bitmap, set the summary bit once its word fills up
+void mark_frame_allocated(int frame_num){
+    int idx = frame_num - FIRST_USABLE_FRAME;
+    int word = idx / 64;
+    frame_bitmap[word] |= (uint64_t)1 << (idx % 64);
+    if(frame_bitmap[word] == ~(uint64_t)0){
+        frame_summary[word / 64] |= (uint64_t)1 << (word % 64);
+    }
+}
+
+// mark frame as free in the bitmap, its word can no longer be full
+void mark_frame_free(int frame_num){
+    int idx = frame_num - FIRST_USABLE_FRAME;
+    int word = idx / 64;
+    frame_bitmap[word] &= ~((uint64_t)1 << (idx % 64));
+    frame_summary[word / 64] &= ~((uint64_t)1 << (word % 64));
+}
+
+// first free frame of the zone, or -1 if the zone is full
+int get_free_page_frame_index(struct frame_zone* zone){
+    // the summary has one bit per bitmap word, so the first summary word that is not all ones
+    // points at the first bitmap word with a free frame, and find-first-zero on that word gives the frame
+    // only the summary bits of the zone's own words are looked at
+    int first_word = (zone->first_frame - FIRST_USABLE_FRAME) / 64;
+    int end_word = first_word + zone->num_frames / 64;
+    for(int i=first_word/64; i*64<end_word; i++){
+        uint64_t full = frame_summary[i];
+        // words outside the zone count as full
+        if(i*64 < first_word){
+            full |= ((uint64_t)1 << (first_word - i*64)) - 1;
+        }
+        if(i*64 + 64 > end_word){
+            full |= ~(uint64_t)0 << (end_word - i*64);
+        }
+        if(full != ~(uint64_t)0){
+            int word = i*64 + __builtin_ctzll(~full);
+            int idx = word*64 + __builtin_ctzll(~frame_bitmap[word]);
+            return FIRST_USABLE_FRAME + idx;
+        }
+    }
+    return -1;
+} 
+
+// ------------------------------- buddy allocator for contiguous frames ------------------------------ //
+
+void buddy_push(struct frame_zone* zone, int idx, int order){
+    buddy->order[idx] = order;
+    buddy->prev[idx] = -1;
+    buddy->next[idx] = zone->free_head[order];
+    if(zone->free_head[order] != -1){
+        buddy->prev[zone->free_head[order]] = idx;
+    }
+    zone->free_head[order] = idx;
+    zone->free_count[order]++;
+}
+
+void buddy_remove(struct frame_zone* zone, int idx, int order){
+    if(buddy->prev[idx] != -1){
+        buddy->next[buddy->prev[idx]] = buddy->next[idx];
+    }else{
+        zone->free_head[order] = buddy->next[idx];
+    }
+    if(buddy->next[idx] != -1){
+        buddy->prev[buddy->next[idx]] = buddy->prev[idx];
+    }
+    buddy->order[idx] = -1;
+    zone->free_count[order]--;
+}
+
+void buddy_init(){
+    buddy->free_frames = USABLE_FRAMES;
+    buddy->dirty_frames = 0;
+    buddy->zeroing_frames = 0;
+    buddy->reserved_frames = 0;
+    buddy->num_zones = num_zones;
+    buddy->interleave_next = 0;
+    memset(buddy->order, -1, USABLE_FRAMES);
+    assert(num_zones >= 1 && num_zones <= MAX_ZONES);
+    int first_frame = FIRST_USABLE_FRAME;
+    for(int z=0; z<num_zones; z++){
+        struct frame_zone* zone = &buddy->zones[z];
+        zone->first_frame = first_frame;
+        zone->num_frames = zone_sizes[0] ? zone_sizes[z] : USABLE_FRAMES / num_zones;
+        assert(zone->num_frames > 0 && zone->num_frames % (1<<BUDDY_MAX_ORDER) == 0);
+        zone->free_frames = zone->num_frames;
+        zone->frames_allocated = 0;
+        zone->frames_freed = 0;
+        zone->fallback_frames = 0;
+        zone->frames_zeroed = 0;
+        zone->dirty_head = -1;
+        zone->dirty_frames = 0;
+        for(int order=0; order<=BUDDY_MAX_ORDER; order++){
+            zone->free_head[order] = -1;
+            zone->free_count[order] = 0;
+        }
+        // zones start on a max order boundary so no buddy block ever crosses into the next zone
+        for(int idx=first_frame-FIRST_USABLE_FRAME; idx<first_frame-FIRST_USABLE_FRAME+zone->num_frames; idx+=(1<<BUDDY_MAX_ORDER)){
+            buddy_push(zone, idx, BUDDY_MAX_ORDER);
+        }
+        first_frame += zone->num_frames;
+    }
+    assert(first_frame == FIRST_USABLE_FRAME + USABLE_FRAMES);
+}
+
+struct frame_zone* zone_of_frame(int frame){
+    int z = 0;
+    while(frame >= buddy->zones[z].first_frame + buddy->zones[z].num_frames){
+        z++;
+    }
+    return &buddy->zones[z];
+}
+
+// take the single free frame idx out of the free block that contains it
+// the block is split down and every half that does not contain idx goes back on its free list
+void buddy_carve(struct frame_zone* zone, int idx){
+    int order = 0;
+    int head = idx;
+    while(buddy->order[head] != order){
+        order++;
+        head = idx & ~((1<<order) - 1);
+        assert(order <= BUDDY_MAX_ORDER);
+    }
+    buddy_remove(zone, head, order);
+    while(order > 0){
+        order--;
+        int half = head + (1<<order);
+        if(idx >= half){
+            buddy_push(zone, head, order);
+            head = half;
+        }else{
+            buddy_push(zone, half, order);
+        }
+    }
+}
+
+// allocate 2^order physically contiguous frames from the zone, returns the first frame number or -1
+int alloc_frames_contig(struct frame_zone* zone, int order){
+    int found = order;
+    while(found <= BUDDY_MAX_ORDER && zone->free_head[found] == -1){
+        found++;
+    }
+    if(found > BUDDY_MAX_ORDER){
+        return -1;
+    }
+    int head = zone->free_head[found];
+    buddy_remove(zone, head, found);
+    // split the block, the upper halves go back on the free lists
+    while(found > order){
+        found--;
+        buddy_push(zone, head + (1<<found), found);
+    }
+    for(int i=0; i<(1<<order); i++){
+        mark_frame_allocated(FIRST_USABLE_FRAME + head + i);
+    }
+    zone->free_frames -= 1<<order;
+    buddy->free_frames -= 1<<order;
+    return FIRST_USABLE_FRAME + head;
+}
+
+// single frames are placed lowest address first using the bitmap,
+// which keeps the high end of the zone in large blocks for contiguous requests
+int zone_alloc_frame(struct frame_zone* zone){
+    int frame = get_free_page_frame_index(zone);
+    if(frame == -1){
+        return -1;
+    }
+    buddy_carve(zone, frame - FIRST_USABLE_FRAME);
+    mark_frame_allocated(frame);
+    zone->free_frames--;
+    buddy->free_frames--;
+    return frame;
+}
+
+// free 2^order contiguous frames starting at frame, coalescing with free buddies
+void free_frames_contig(int frame, int order){
+    struct frame_zone* zone = zone_of_frame(frame);
+    int idx = frame - FIRST_USABLE_FRAME;
+    for(int i=0; i<(1<<order); i++){
+        mark_frame_free(frame + i);
+    }
+    zone->free_frames += 1<<order;
+    zone->frames_freed += 1<<order;
+    buddy->free_frames += 1<<order;
+    while(order < BUDDY_MAX_ORDER){
+        int buddy_idx = idx ^ (1<<order);
+        if(buddy->order[buddy_idx] != order){
+            break;
+        }
+        buddy_remove(zone, buddy_idx, order);
+        idx = idx < buddy_idx ? idx : buddy_idx;
+        order++;
+    }
+    buddy_push(zone, idx, order);
+}
+
+void free_frame(int frame){
+    free_frames_contig(frame, 0);
+}
+
+// allocate a contiguous run of at most num_frames frames from one zone, the largest power of two it has
+int zone_alloc_run(struct frame_zone* zone, int num_frames, int* run_len){
+    if(zone->free_frames == 0){
+        return -1;
+    }
+    int order = 0;
+    while(order < BUDDY_MAX_ORDER && (2<<order) <= num_frames){
+        order++;
+    }
+    for(; order>0; order--){
+        int frame = alloc_frames_contig(zone, order);
+        if(frame != -1){
+            *run_len = 1<<order;
+            return frame;
+        }
+    }
+    *run_len = 1;
+    return zone_alloc_frame(zone);
+}
+
+// allocate a contiguous run of at most num_frames frames, the zone is picked by zone_policy
+// the number of frames in the run is stored in run_len, returns the first frame number or -1
+// caller holds frame_pool_lock, it is released while dirty frames are zeroed and while waiting for
+// frames another thread is zeroing
+int alloc_frame_run(int num_frames, int* run_len){
+    int start = current_zone % buddy->num_zones;
+    if(zone_policy == ZONE_INTERLEAVE){
+        start = buddy->interleave_next;
+        buddy->interleave_next = (start + 1) % buddy->num_zones;
+        if(num_frames > ZONE_INTERLEAVE_FRAMES){
+            num_frames = ZONE_INTERLEAVE_FRAMES;
+        }
+    }
+    // clean frames anywhere are preferred, dirty frames are only zeroed here when no zone has clean ones left
+    // frames other threads are zeroing will be clean soon, they are waited for before giving up
+    for(;;){
+        for(int pass=0; pass<2; pass++){
+            for(int i=0; i<buddy->num_zones; i++){
+                struct frame_zone* zone = &buddy->zones[(start + i) % buddy->num_zones];
+                if(pass == 1){
+                    sync_zeroed_frames += zone_zero_dirty(zone, num_frames);
+                }
+                int frame = zone_alloc_run(zone, num_frames, run_len);
+                if(frame != -1){
+                    zone->frames_allocated += *run_len;
+                    if(i > 0 && zone_policy == ZONE_LOCAL_FIRST){
+                        zone->fallback_frames += *run_len;
+                    }
+                    return frame;
+                }
+            }
+        }
+        if(buddy->zeroing_frames == 0){
+            return -1;
+        }
+        pthread_cond_wait(&zeroed_frames_cond, &frame_pool_lock);
+    }
+}
+
+// frames of the shared pool not promised to any request, caller holds frame_pool_lock
+int pool_unreserved(){
+    return buddy->free_frames + buddy->dirty_frames + buddy->zeroing_frames - buddy->reserved_frames;
+}
+
+// a single frame without a reservation, only if no request was promised it
+int alloc_frame(){
+    int run_len;
+    pthread_mutex_lock(&frame_pool_lock);
+    int frame = pool_unreserved() > 0 ? alloc_frame_run(1, &run_len) : -1;
+    pthread_mutex_unlock(&frame_pool_lock);
+    return frame;
+}
+
+void print_zone_stats(){
+    puts("------ Printing zone stats -------");
+    for(int z=0; z<buddy->num_zones; z++){
+        struct frame_zone* zone = &buddy->zones[z];
+        printf("Zone %d: frames %d - %d, free: %d, dirty: %d, allocated: %lld, freed: %lld, fallback: %lld, zeroed: %lld\n",
+                z,
+                zone->first_frame,
+                zone->first_frame + zone->num_frames - 1,
+                zone->free_frames,
+                zone->dirty_frames,
+                zone->frames_allocated,
+                zone->frames_freed,
+                zone->fallback_frames,
+                zone->frames_zeroed
+                );
+    }
+    printf("Zeroed on the allocation path: %lld, zeroing time: %.0f us\n", sync_zeroed_frames, zeroing_ns / 1e3);
+}
+
+// ------------------------------- pre-zeroed frames ------------------------------ //
+
+// a freed frame still holds the data of the process that used it, so it is parked on its zone's
+// dirty list and only goes back to the free lists after it has been zeroed
+// the free lists (and the magazines filled from them) therefore only ever hold zeroed frames
+
+double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// caller holds frame_pool_lock
+void push_dirty_frame(int frame){
+    struct frame_zone* zone = zone_of_frame(frame);
+    int idx = frame - FIRST_USABLE_FRAME;
+    buddy->next[idx] = zone->dirty_head;
+    zone->dirty_head = idx;
+    zone->dirty_frames++;
+    buddy->dirty_frames++;
+    zone->frames_freed++;
+}
+
+// zero up to max_frames dirty frames of the zone and put them on its free lists
+// caller holds frame_pool_lock. The frames are taken off the dirty list ZERO_BATCH at a time and zeroed
+// with the lock released, so allocations and frees of other threads never wait for a memset
+// returns the number of frames zeroed
+int zone_zero_dirty(struct frame_zone* zone, int max_frames){
+    int zeroed = 0;
+    while(zeroed < max_frames && zone->dirty_head != -1){
+        int batch[ZERO_BATCH];
+        int count = 0;
+        while(count < ZERO_BATCH && zeroed + count < max_frames && zone->dirty_head != -1){
+            batch[count] = zone->dirty_head;
+            zone->dirty_head = buddy->next[batch[count++]];
+        }
+        zone->dirty_frames -= count;
+        buddy->dirty_frames -= count;
+        buddy->zeroing_frames += count;
+        pthread_mutex_unlock(&frame_pool_lock);
+        double start = now_ns();
+        for(int i=0; i<count; i++){
+            memset(PS_MEM + (long)batch[i]*PAGE_SIZE, 0, PAGE_SIZE);
+        }
+        double elapsed = now_ns() - start;
+        pthread_mutex_lock(&frame_pool_lock);
+        for(int i=0; i<count; i++){
+            free_frame(FIRST_USABLE_FRAME + batch[i]);
+        }
+        zone->frames_freed -= count;   // counted once already when they went on the dirty list
+        zone->frames_zeroed += count;
+        buddy->zeroing_frames -= count;
+        zeroing_ns += elapsed;
+        pthread_cond_broadcast(&zeroed_frames_cond);
+        zeroed += count;
+    }
+    return zeroed;
+}
+
+// idle time hook: zero up to max_frames dirty frames, ZERO_BATCH at a time, returns the number of frames zeroed
+int zero_dirty_frames(int max_frames){
+    int zeroed = 0;
+    while(zeroed < max_frames){
+        int batch = max_frames - zeroed < ZERO_BATCH ? max_frames - zeroed : ZERO_BATCH;
+        int done = 0;
+        pthread_mutex_lock(&frame_pool_lock);
+        for(int z=0; z<buddy->num_zones && done<batch; z++){
+            done += zone_zero_dirty(&buddy->zones[z], batch - done);
+        }
+        pthread_mutex_unlock(&frame_pool_lock);
+        if(done == 0){
+            break;
+        }
+        zeroed += done;
+    }
+    return zeroed;
+}
+
+// background worker that zeroes dirty frames whenever there are any
+void* zeroing_worker(void* arg){
+    (void)arg;
+    pthread_mutex_lock(&frame_pool_lock);
+    while(zeroing_worker_running){
+        if(buddy->dirty_frames == 0){
+            pthread_cond_wait(&dirty_frames_cond, &frame_pool_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&frame_pool_lock);
+        zero_dirty_frames(ZERO_BATCH);
+        pthread_mutex_lock(&frame_pool_lock);
+    }
+    pthread_mutex_unlock(&frame_pool_lock);
+    return NULL;
+}
+
+void start_zeroing_worker(){
+    zeroing_worker_running = 1;
+    pthread_create(&zeroing_thread, NULL, zeroing_worker, NULL);
+}
+
+void stop_zeroing_worker(){
+    pthread_mutex_lock(&frame_pool_lock);
+    zeroing_worker_running = 0;
+    pthread_cond_signal(&dirty_frames_cond);
+    pthread_mutex_unlock(&frame_pool_lock);
+    pthread_join(zeroing_thread, NULL);
+}
+
+// a run of length physically contiguous frames starting at start_frame
+struct frame_extent {
+    int start_frame;
+    int length;
+};
+
+// ------------------------------- per-thread frame magazines ------------------------------ //
+
+// every thread keeps a small stack of free frames of its own so that most small requests never
+// touch the shared pool, neither to reserve their frames nor to allocate them. The magazine is
+// refilled from the pool in batches. Frames the thread frees collect in its dirty batch, the most
+// recently freed are handed out again first (zeroed on the way, while still in the cache) and the
+// oldest go on the dirty lists in batches when it fills up
+
+// frames the calling thread holds that no request was promised yet
+int magazine_spare(){
+    return magazine.count + dirty_batch.count - magazine_reserved;
+}
+
+// top the magazine up until the thread has MAGAZINE_BATCH spare frames
+// frames the pool promised to other requests stay where they are
+void magazine_refill(){
+    pthread_mutex_lock(&frame_pool_lock);
+    while(magazine_spare() < MAGAZINE_BATCH && magazine.count < MAGAZINE_SIZE){
+        int want = MAGAZINE_BATCH - magazine_spare();
+        if(want > MAGAZINE_SIZE - magazine.count){
+            want = MAGAZINE_SIZE - magazine.count;
+        }
+        if(want > pool_unreserved()){
+            want = pool_unreserved();
+        }
+        if(want <= 0){
+            break;
+        }
+        int run_len;
+        int frame = alloc_frame_run(want, &run_len);
+        if(frame == -1){
+            break;
+        }
+        // pushed highest first so that they pop out in address order
+        for(int i=run_len-1; i>=0; i--){
+            magazine.frames[magazine.count++] = frame + i;
+        }
+    }
+    pthread_mutex_unlock(&frame_pool_lock);
+}
+
+// next frame for a request the thread reserved frames for, a recently freed one if there is any
+int magazine_pop(){
+    if(dirty_batch.count > 0){
+        int frame = dirty_batch.frames[--dirty_batch.count];
+        memset(frame_to_mem(frame), 0, PAGE_SIZE);
+        return frame;
+    }
+    return magazine.frames[--magazine.count];
+}
+
+// hand the frames freed by the calling thread over to the dirty lists, all but the keep most recent ones
+// and those the thread's reservations still need
+void dirty_batch_flush(int keep){
+    if(keep < magazine_reserved - magazine.count){
+        keep = magazine_reserved - magazine.count;
+    }
+    int flush = dirty_batch.count - keep;
+    if(flush <= 0){
+        return;
+    }
+    pthread_mutex_lock(&frame_pool_lock);
+    for(int i=0; i<flush; i++){
+        push_dirty_frame(dirty_batch.frames[i]);
+    }
+    pthread_cond_signal(&dirty_frames_cond);
+    pthread_mutex_unlock(&frame_pool_lock);
+    memmove(dirty_batch.frames, dirty_batch.frames + flush, (dirty_batch.count - flush) * sizeof(int));
+    dirty_batch.count -= flush;
+}
+
+// give every frame held by the calling thread back to the shared pool
+// a thread that used the MMU should call this before it exits
+void magazine_flush(){
+    pthread_mutex_lock(&frame_pool_lock);
+    while(magazine.count > 0){
+        free_frame(magazine.frames[--magazine.count]);
+    }
+    pthread_mutex_unlock(&frame_pool_lock);
+    dirty_batch_flush(0);
+}
+
+// return the magazine and dirty batch frames of the calling thread that no reservation needs to the pool
+void magazine_give_back(){
+    dirty_batch_flush(0);
+    pthread_mutex_lock(&frame_pool_lock);
+    while(magazine.count > magazine_reserved){
+        free_frame(magazine.frames[--magazine.count]);
+    }
+    pthread_mutex_unlock(&frame_pool_lock);
+}
+
+// free a single frame that was mapped by a process, it has to be zeroed before it is handed out again
+void release_frame(int frame){
+    if(use_magazines){
+        if(dirty_batch.count == MAGAZINE_BATCH){
+            dirty_batch_flush(MAGAZINE_BATCH / 2);
+        }
+        dirty_batch.frames[dirty_batch.count++] = frame;
+    }else{
+        pthread_mutex_lock(&frame_pool_lock);
+        push_dirty_frame(frame);
+        pthread_cond_signal(&dirty_frames_cond);
+        pthread_mutex_unlock(&frame_pool_lock);
+    }
+}
+
+// take another reference to a frame that is mapped or pinned
+void frame_get(int frame){
+    if(frame == zero_frame){
+        return;
+    }
+    __atomic_add_fetch(&frame_ref(frame), 1, __ATOMIC_SEQ_CST);
+}
+
+// take a reference unless the last one is already gone, returns 0 in that case
+int frame_get_unless_free(int frame){
+    if(frame == zero_frame){
+        return 1;
+    }
+    int refs = __atomic_load_n(&frame_ref(frame), __ATOMIC_SEQ_CST);
+    while(refs > 0){
+        if(__atomic_compare_exchange_n(&frame_ref(frame), &refs, refs + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// drop a reference, the last one frees the frame
+void frame_put(int frame){
+    if(frame == zero_frame){
+        return;
+    }
+    if(__atomic_sub_fetch(&frame_ref(frame), 1, __ATOMIC_SEQ_CST) == 0){
+        release_frame(frame);
+    }
+}
+
+// requests that reserve_frames charges to the calling thread's magazine instead of the shared pool
+int magazine_request(int num_frames){
+    return use_magazines && num_frames <= MAGAZINE_MAX_REQUEST;
+}
+
+// admission control: promise num_frames frames to a request before it does any work
+// returns 0 on success, -1 right away if the frames are not there
+// small requests are charged to the calling thread's magazine, refilled first if it holds too few
+// frames nobody was promised, so as long as it does they take no lock at all. Larger ones are charged
+// to the shared pool, where dirty frames count too since an allocation that finds no clean frame zeroes
+// dirty ones itself (or waits for those being zeroed)
+int reserve_frames(int num_frames){
+    if(num_frames == 0){
+        return 0;
+    }
+    if(magazine_request(num_frames)){
+        if(magazine_spare() < num_frames){
+            magazine_refill();
+        }
+        if(magazine_spare() >= num_frames){
+            magazine_reserved += num_frames;
+            return 0;
+        }
+    }else{
+        pthread_mutex_lock(&frame_pool_lock);
+        if(pool_unreserved() >= num_frames){
+            buddy->reserved_frames += num_frames;
+            pthread_mutex_unlock(&frame_pool_lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&frame_pool_lock);
+        // the frames the thread holds itself that nobody was promised are given to the pool before giving up
+        if(magazine_spare() > 0){
+            magazine_give_back();
+            return reserve_frames(num_frames);
+        }
+    }
+    // cached images nobody maps anymore are given up before a request is turned down
+    if(image_cache_shrink() > 0){
+        return reserve_frames(num_frames);
+    }
+    return -1;
+}
+
+void unreserve_frames(int num_frames){
+    if(num_frames == 0){
+        return;
+    }
+    if(magazine_request(num_frames)){
+        magazine_reserved -= num_frames;
+        return;
+    }
+    pthread_mutex_lock(&frame_pool_lock);
+    buddy->reserved_frames -= num_frames;
+    pthread_mutex_unlock(&frame_pool_lock);
+}
+
+// add a run of frames to the extents, merged into the last one if it continues it, returns the new count
+int add_extent(struct frame_extent* extents, int count, int frame, int run_len){
+    if(count > 0 && extents[count-1].start_frame + extents[count-1].length == frame){
+        extents[count-1].length += run_len;
+        return count;
+    }
+    extents[count].start_frame = frame;
+    extents[count].length = run_len;
+    return count + 1;
+}
+
+// allocate num_frames frames as a few contiguous extents, adjacent runs are merged into one extent
+// the caller must hold a reservation for num_frames (reserve_frames), which is used up here
+// extents_out needs room for num_frames extents in the worst case
+// returns the number of extents, or -1 (with nothing allocated and the reservation dropped) on failure
+// small requests take the frames reserve_frames set aside in the calling thread's magazine without
+// locking, larger ones take contiguous runs from the shared pool under one hold of frame_pool_lock
+int alloc_frames(int num_frames, struct frame_extent* extents_out){
+    int count = 0;
+    if(magazine_request(num_frames)){
+        magazine_reserved -= num_frames;
+        for(int i=0; i<num_frames; i++){
+            count = add_extent(extents_out, count, magazine_pop(), 1);
+        }
+        return count;
+    }
+    int remaining = num_frames;
+    pthread_mutex_lock(&frame_pool_lock);
+    while(remaining > 0){
+        int run_len;
+        int frame = alloc_frame_run(remaining, &run_len);
+        if(frame == -1){
+            for(int i=0; i<count; i++){
+                for(int j=0; j<extents_out[i].length; j++){
+                    free_frame(extents_out[i].start_frame + j);
+                }
+            }
+            count = -1;
+            break;
+        }
+        count = add_extent(extents_out, count, frame, run_len);
+        remaining -= run_len;
+    }
+    buddy->reserved_frames -= num_frames;
+    pthread_mutex_unlock(&frame_pool_lock);
+    return count;
+}
+
+void free_frames(struct frame_extent* extents, int count){
+    pthread_mutex_lock(&frame_pool_lock);
+    for(int i=0; i<count; i++){
+        for(int j=0; j<extents[i].length; j++){
+            free_frame(extents[i].start_frame + j);
+        }
+    }
+    pthread_mutex_unlock(&frame_pool_lock);
+}
+
+// ------------------------------- hashed page table backend ------------------------------ //
+
+int hashed_bucket(int slot, int page){
+    return ((unsigned int)(slot * NUM_PAGES + page) * 0x9e3779b1u) >> (32 - hashed_bucket_bits);
+}
+
+// index of the entry for page of the process in slot, or -1, hashed_pt_lock must be held
+int hashed_find(int slot, int page){
+    int idx = hashed_buckets[hashed_bucket(slot, page)];
+    while(idx != -1 && (hashed_ptes[idx].slot != slot || hashed_ptes[idx].page != page)){
+        idx = hashed_ptes[idx].hash_next;
+    }
+    return idx;
+}
+
+// add an empty entry for page, hashed_pt_lock must be held and a free entry must exist
+void hashed_insert(int slot, int page){
+    int idx = hashed_free_head;
+    struct hashed_pte* e = &hashed_ptes[idx];
+    hashed_free_head = e->hash_next;
+    hashed_free_count--;
+    int b = hashed_bucket(slot, page);
+    e->slot = slot;
+    e->page = page;
+    e->pte = 0;
+    e->hash_next = hashed_buckets[b];
+    hashed_buckets[b] = idx;
+    e->proc_prev = -1;
+    e->proc_next = proc_hashed_head[slot];
+    if(e->proc_next != -1){
+        hashed_ptes[e->proc_next].proc_prev = idx;
+    }
+    proc_hashed_head[slot] = idx;
+}
+
+// unlink the entry from its bucket and its process and put it on the free list, hashed_pt_lock must be held
+void hashed_remove(int idx){
+    struct hashed_pte* e = &hashed_ptes[idx];
+    int* link = &hashed_buckets[hashed_bucket(e->slot, e->page)];
+    while(*link != idx){
+        link = &hashed_ptes[*link].hash_next;
+    }
+    *link = e->hash_next;
+    if(e->proc_prev != -1){
+        hashed_ptes[e->proc_prev].proc_next = e->proc_next;
+    }else{
+        proc_hashed_head[e->slot] = e->proc_next;
+    }
+    if(e->proc_next != -1){
+        hashed_ptes[e->proc_next].proc_prev = e->proc_prev;
+    }
+    e->slot = -1;
+    e->hash_next = hashed_free_head;
+    hashed_free_head = idx;
+    hashed_free_count++;
+}
+
+// ------------------------------- software TLB ------------------------------ //
+
+// set of the TLB a page of an address space maps to. Consecutive pages go to consecutive sets and the
+// ASID picks the starting set by Fibonacci hashing, which spreads the small ASIDs of one generation evenly
+int tlb_set(int asid, int page){
+    int offset = (int)(((uint64_t)((unsigned)asid * 0x9e3779b1u) << tlb_set_bits) >> 32);
+    return (page + offset) & (tlb_sets - 1);
+}
+
+// take a set for a fill or an invalidation, spinning while someone else holds it
+void tlb_lock_set(int set){
+    unsigned seq = __atomic_load_n(&tlb_set_seq[set], __ATOMIC_RELAXED);
+    while((seq & 1) || !__atomic_compare_exchange_n(&tlb_set_seq[set], &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        seq = __atomic_load_n(&tlb_set_seq[set], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// take a set only if nobody changed it since its sequence number was seq, returns 0 otherwise
+int tlb_trylock_set(int set, unsigned seq){
+    if((seq & 1) || !__atomic_compare_exchange_n(&tlb_set_seq[set], &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        return 0;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return 1;
+}
+
+void tlb_unlock_set(int set){
+    __atomic_store_n(&tlb_set_seq[set], tlb_set_seq[set] + 1, __ATOMIC_RELEASE);
+}
+
+// drop every cached translation, tlb_lock must be held (or the TLB not yet in use)
+// sets that are empty and not held by a fill are skipped without locking them
+void tlb_flush(){
+    for(int set=0; set<tlb_sets; set++){
+        unsigned seq = __atomic_load_n(&tlb_set_seq[set], __ATOMIC_SEQ_CST);
+        int empty = !(seq & 1);
+        for(int w=0; w<tlb_ways && empty; w++){
+            empty = __atomic_load_n(&tlb_entries[(long)set * tlb_ways + w].page, __ATOMIC_RELAXED) == TLB_NO_PAGE;
+        }
+        if(empty && __atomic_load_n(&tlb_set_seq[set], __ATOMIC_ACQUIRE) == seq){
+            continue;
+        }
+        tlb_lock_set(set);
+        for(int w=0; w<tlb_ways; w++){
+            tlb_entries[(long)set * tlb_ways + w].page = TLB_NO_PAGE;
+        }
+        tlb_unlock_set(set);
+    }
+}
+
+// ASID of the process in slot in the current generation with the generation in the upper 32 bits,
+// assigned on first use. Only the assignment takes tlb_lock, a process that has one just reads it.
+// exited processes keep their ASID until the generation ends, so their stale entries never match anyone
+long long tlb_asid(int slot){
+    long long asid = __atomic_load_n(&proc_asid[slot], __ATOMIC_ACQUIRE);
+    if((asid >> 32) == __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE)){
+        return asid;
+    }
+    pthread_mutex_lock(&tlb_lock);
+    if((proc_asid[slot] >> 32) != asid_generation){
+        if(asid_next == tlb_asids){
+            // generation used up, every live process gets a new ASID on its next access
+            // the new generation is published first so that no fill with an old ASID gets past the flush
+            __atomic_store_n(&asid_generation, asid_generation + 1, __ATOMIC_SEQ_CST);
+            asid_next = 0;
+            tlb_flush();
+            tlb_counters.rollovers++;
+            __atomic_add_fetch(&tlb_counters.flushes, 1, __ATOMIC_RELAXED);
+        }
+        __atomic_store_n(&proc_asid[slot], (asid_generation << 32) | asid_next++, __ATOMIC_RELEASE);
+    }
+    asid = proc_asid[slot];
+    pthread_mutex_unlock(&tlb_lock);
+    return asid;
+}
+
+// drop the cached translation of one page, must be called whenever its pte changes, after the new entry is in place
+void tlb_invalidate(int slot, int page){
+    long long asid = __atomic_load_n(&proc_asid[slot], __ATOMIC_ACQUIRE);
+    // a process that never had an ASID has nothing in the TLB, entries of an old generation are only
+    // dropped by the rollover's flush, so they are looked for as well
+    if(asid == -1){
+        return;
+    }
+    int set = tlb_set((int)asid, page);
+    struct tlb_entry* ways = &tlb_entries[(long)set * tlb_ways];
+    tlb_lock_set(set);
+    for(int w=0; w<tlb_ways; w++){
+        if(ways[w].page == page && ways[w].asid == (int)asid){
+            ways[w].page = TLB_NO_PAGE;
+        }
+    }
+    tlb_unlock_set(set);
+}
+
+// the process in slot has exited, its entries die with its ASID without a flush
+void tlb_release_asid(int slot){
+    pthread_mutex_lock(&tlb_lock);
+    __atomic_store_n(&proc_asid[slot], -1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&tlb_lock);
+}
+
+// look page up in a set without locking it, returns the way it is cached in or tlb_ways, and copies the
+// entry to hit. *seq is the sequence number the lookup is valid for, odd if the set was held by a writer
+int tlb_lookup(int set, int asid, int page, unsigned* seq, struct tlb_entry* hit){
+    struct tlb_entry* ways = &tlb_entries[(long)set * tlb_ways];
+    int way;
+    do{
+        *seq = __atomic_load_n(&tlb_set_seq[set], __ATOMIC_ACQUIRE);
+        if(*seq & 1){
+            return tlb_ways;
+        }
+        for(way=0; way<tlb_ways; way++){
+            if(__atomic_load_n(&ways[way].page, __ATOMIC_RELAXED) == page &&
+               __atomic_load_n(&ways[way].asid, __ATOMIC_RELAXED) == asid){
+                hit->flags = __atomic_load_n(&ways[way].flags, __ATOMIC_RELAXED);
+                hit->frame = __atomic_load_n(&ways[way].frame, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    }while(__atomic_load_n(&tlb_set_seq[set], __ATOMIC_RELAXED) != *seq);
+    return way;
+}
+
+// put a translation in the front of its set, the set must be locked
+// hits do not write to the set, so replacement is in fill order: the least recently filled way goes
+void tlb_fill(int set, int asid, int page, int flags, unsigned char* frame){
+    struct tlb_entry* ways = &tlb_entries[(long)set * tlb_ways];
+    int way = 0;
+    while(way < tlb_ways && (ways[way].page != page || ways[way].asid != asid)){
+        way++;
+    }
+    if(way == tlb_ways){
+        way = tlb_ways - 1;
+        if(ways[way].page != TLB_NO_PAGE){
+            __atomic_add_fetch(&tlb_counters.evictions, 1, __ATOMIC_RELAXED);
+        }
+    }
+    for(; way>0; way--){
+        ways[way] = ways[way - 1];
+    }
+    ways[0].asid = asid;
+    ways[0].page = page;
+    ways[0].flags = flags;
+    ways[0].frame = frame;
+}
+
+page_table_entry* pte_lookup(int slot, int page);
+
+// set the accessed bit of a present pte, and the dirty bit for a write, unless they are set already.
+// entry is the value last read from it, the new value is returned
+page_table_entry pte_mark_entry(page_table_entry* pte, page_table_entry entry, int access){
+    page_table_entry bits = PTE_ACCESSED | (access == O_WRITE ? PTE_DIRTY : 0);
+    if((entry & bits) != bits){
+        entry = __atomic_or_fetch(pte, bits, __ATOMIC_ACQ_REL);
+    }
+    return entry;
+}
+
+// pte_mark_entry for page of the address space in slot
+void pte_mark(int slot, int page, int access){
+    page_table_entry* pte = pte_lookup(slot, page);
+    if(pte != NULL){
+        pte_mark_entry(pte, __atomic_load_n(pte, __ATOMIC_ACQUIRE), access);
+    }
+}
+
+// address of the frame behind page if the process in slot may access it as asked (O_READ or O_WRITE),
+// NULL otherwise. Hits are served from the TLB without taking any lock, a miss walks the page table
+// without holding the set and fills it afterwards, unless the set changed meanwhile (an invalidation
+// could have raced with the walk). Like a hardware TLB the fill sets the accessed bit and the first
+// write through an entry sets the dirty bit.
+unsigned char* tlb_access(int slot, int page, int access){
+    long long asid = 0;
+    int set = 0;
+    unsigned seq = 1;
+    if(use_tlb){
+        asid = tlb_asid(slot);
+        if(!use_asids && (int)asid != __atomic_load_n(&tlb_last_asid, __ATOMIC_RELAXED)){
+            pthread_mutex_lock(&tlb_lock);
+            if((int)asid != tlb_last_asid){
+                tlb_flush();
+                __atomic_add_fetch(&tlb_counters.flushes, 1, __ATOMIC_RELAXED);
+                __atomic_store_n(&tlb_last_asid, (int)asid, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&tlb_lock);
+        }
+        set = tlb_set((int)asid, page);
+        struct tlb_entry hit;
+        int way = tlb_lookup(set, (int)asid, page, &seq, &hit);
+        // after a rollover the ASID may already tag entries of another process, the page table decides
+        if((asid >> 32) != __atomic_load_n(&asid_generation, __ATOMIC_ACQUIRE)){
+            way = tlb_ways;
+        }
+        if(way < tlb_ways && (access != O_WRITE || (hit.flags & TLB_DIRTY))){
+            __atomic_add_fetch(&tlb_counters.hits, 1, __ATOMIC_RELAXED);
+            return (hit.flags & access) ? hit.frame : NULL;
+        }
+    }
+    __atomic_add_fetch(&tlb_counters.misses, 1, __ATOMIC_RELAXED);
+    page_table_entry* pte = pte_lookup(slot, page);
+    if(pte == NULL){
+        return NULL;
+    }
+    page_table_entry entry = __atomic_load_n(pte, __ATOMIC_ACQUIRE);
+    if(!is_present(entry) || !(get_flags(entry) & access)){
+        return NULL;
+    }
+    entry = pte_mark_entry(pte, entry, access);
+    unsigned char* frame = frame_to_mem(pte_to_frame_num(entry));
+    // a set that changed since the lookup is left alone, the translation is still good for this access
+    if(use_tlb && tlb_trylock_set(set, seq)){
+        // an ASID rollover since tlb_asid would let the entry outlive the flush
+        if(__atomic_load_n(&proc_asid[slot], __ATOMIC_ACQUIRE) == asid &&
+           (asid >> 32) == __atomic_load_n(&asid_generation, __ATOMIC_SEQ_CST)){
+            tlb_fill(set, (int)asid, page, get_flags(entry) | ((entry & PTE_DIRTY) ? TLB_DIRTY : 0), frame);
+        }
+        tlb_unlock_set(set);
+    }
+    return frame;
+}
+
+// count a memory access to the address space in slot from its translation to its last byte, so that
+// ksm_scan can wait for it before it compares or moves the page. While the scanner holds the address
+// space the access waits for it on the lock, uncounted. Never held across a page fault or exit_ps.
+// inline, every read_mem and write_mem pays for it: one acquire increment, the count and the flag share
+// a word so either the increment comes first and mm_quiesce waits for it, or it sees the flag
+static inline void mm_access_begin(int slot){
+    struct mm_access* access = &proc_mm_access[slot];
+    while(__atomic_fetch_add(&access->state, 1, __ATOMIC_ACQUIRE) & MM_QUIESCE){
+        __atomic_sub_fetch(&access->state, 1, __ATOMIC_RELAXED);
+        mm_lock(slot);
+        mm_unlock(slot);
+    }
+}
+
+static inline void mm_access_end(int slot){
+    __atomic_sub_fetch(&proc_mm_access[slot].state, 1, __ATOMIC_RELEASE);
+}
+
+// tlb_access for the memory accesses of processes, an access the page table does not allow goes through
+// page_fault, which maps a reserved page or copies a copy on write page
+// the caller has begun the access (mm_access_begin), it is ended while the fault is handled. ksm_scan may
+// merge the page again before the access is back, then it faults again
+unsigned char* tlb_translate(int slot, int page, int access){
+    unsigned char* frame = tlb_access(slot, page, access);
+    while(frame == NULL){
+        mm_access_end(slot);
+        int fault = page_fault(slot, page, access);
+        mm_access_begin(slot);
+        if(fault != 0){
+            break;
+        }
+        frame = tlb_access(slot, page, access);
+    }
+    return frame;
+}
+
+void print_tlb_stats(){
+    struct tlb_counters c = tlb_counters;
+    printf("TLB: %d sets x %d ways, %lld hits, %lld misses, %.2f%% hit rate, %lld evictions, %lld ASID rollovers, %lld flushes\n",
+            tlb_sets, tlb_ways, c.hits, c.misses, c.hits + c.misses > 0 ? 100.0 * c.hits / (c.hits + c.misses) : 0.0,
+            c.evictions, c.rollovers, c.flushes);
+}
+
+// ------------------------------- page table access, both backends ------------------------------ //
+
+// entry of page in the page table of the process in slot, NULL if no entry exists for it
+// (two level: the second level table is not allocated, hashed: the page was never mapped)
+page_table_entry* pte_lookup(int slot, int page){
+    if(page_table_backend == PT_HASHED){
+        pthread_mutex_lock(&hashed_pt_lock);
+        int idx = hashed_find(slot, page);
+        pthread_mutex_unlock(&hashed_pt_lock);
+        // entries are only removed by their own process, so the pointer stays valid after unlocking
+        return idx == -1 ? NULL : &hashed_ptes[idx].pte;
+    }
+    int leaf = pcb_at(slot)->page_dir[page >> PT_LEAF_SHIFT];
+    if(leaf == PT_NO_LEAF){
+        return NULL;
+    }
+    return &page_table_pool[((long)leaf << PT_LEAF_SHIFT) + (page & (PT_LEAF_ENTRIES - 1))];
+}
+
+// entry of page, an unmapped page reads as an empty entry
+page_table_entry pte_get(int slot, int page){
+    page_table_entry* pte = pte_lookup(slot, page);
+    return pte == NULL ? 0 : *pte;
+}
+
+// make sure every page in [first_page, first_page + num_pages) has an entry, that is a second level table
+// or a hashed entry, either all missing ones are allocated or none are, returns -1 if the pool runs out
+int map_page_tables(int slot, int first_page, int num_pages){
+    if(num_pages <= 0){
+        return 0;
+    }
+    if(page_table_backend == PT_HASHED){
+        pthread_mutex_lock(&hashed_pt_lock);
+        int missing = 0;
+        for(int i=first_page; i<first_page + num_pages; i++){
+            missing += hashed_find(slot, i) == -1;
+        }
+        int res = -1;
+        if(missing <= hashed_free_count){
+            for(int i=first_page; i<first_page + num_pages; i++){
+                if(hashed_find(slot, i) == -1){
+                    hashed_insert(slot, i);
+                }
+            }
+            res = 0;
+        }
+        pthread_mutex_unlock(&hashed_pt_lock);
+        return res;
+    }
+    struct PCB* pcb = pcb_at(slot);
+    int first = first_page >> PT_LEAF_SHIFT;
+    int last = (first_page + num_pages - 1) >> PT_LEAF_SHIFT;
+    int missing = 0;
+    for(int d=first; d<=last; d++){
+        missing += pcb->page_dir[d] == PT_NO_LEAF;
+    }
+    if(missing == 0){
+        return 0;
+    }
+    int leaves[PT_DIR_ENTRIES];
+    pthread_mutex_lock(&pcb_table_lock);
+    if(page_table_slots->free_count < missing){
+        pthread_mutex_unlock(&pcb_table_lock);
+        return -1;
+    }
+    for(int i=0; i<missing; i++){
+        leaves[i] = page_table_slots->free_tables[--page_table_slots->free_count];
+    }
+    pthread_mutex_unlock(&pcb_table_lock);
+    for(int d=first, i=0; d<=last; d++){
+        if(pcb->page_dir[d] == PT_NO_LEAF){
+            memset(&page_table_pool[(long)leaves[i] << PT_LEAF_SHIFT], 0, PT_LEAF_SIZE);
+            page_table_used[leaves[i]] = 0;
+            pcb->page_dir[d] = leaves[i++];
+        }
+    }
+    return 0;
+}
+
+// give back the second level tables (or hashed entries) in [first_page, first_page + num_pages)
+// that have no present or reserved entries
+void unmap_page_tables(int slot, int first_page, int num_pages){
+    if(num_pages <= 0){
+        return;
+    }
+    if(page_table_backend == PT_HASHED){
+        pthread_mutex_lock(&hashed_pt_lock);
+        for(int i=first_page; i<first_page + num_pages; i++){
+            int idx = hashed_find(slot, i);
+            if(idx != -1 && !is_mapped(hashed_ptes[idx].pte)){
+                hashed_remove(idx);
+            }
+        }
+        pthread_mutex_unlock(&hashed_pt_lock);
+        return;
+    }
+    struct PCB* pcb = pcb_at(slot);
+    pthread_mutex_lock(&pcb_table_lock);
+    for(int d=first_page >> PT_LEAF_SHIFT; d<=(first_page + num_pages - 1) >> PT_LEAF_SHIFT; d++){
+        int leaf = pcb->page_dir[d];
+        if(leaf != PT_NO_LEAF && page_table_used[leaf] == 0){
+            page_table_slots->free_tables[page_table_slots->free_count++] = leaf;
+            pcb->page_dir[d] = PT_NO_LEAF;
+        }
+    }
+    pthread_mutex_unlock(&pcb_table_lock);
+}
+
+// set the entry of a page that is not mapped yet, map_page_tables must have covered it
+void pte_install(int slot, int page, page_table_entry pte){
+    tlb_invalidate(slot, page);
+    if(page_table_backend == PT_HASHED){
+        *pte_lookup(slot, page) = pte;
+        return;
+    }
+    int leaf = pcb_at(slot)->page_dir[page >> PT_LEAF_SHIFT];
+    page_table_pool[((long)leaf << PT_LEAF_SHIFT) + (page & (PT_LEAF_ENTRIES - 1))] = pte;
+    page_table_used[leaf]++;
+}
+
+// clear the entry of a present or reserved page
+void pte_clear(int slot, int page){
+    if(page_table_backend == PT_HASHED){
+        *pte_lookup(slot, page) = build_pte(0, 0, 0);
+    }else{
+        int leaf = pcb_at(slot)->page_dir[page >> PT_LEAF_SHIFT];
+        page_table_pool[((long)leaf << PT_LEAF_SHIFT) + (page & (PT_LEAF_ENTRIES - 1))] = build_pte(0, 0, 0);
+        page_table_used[leaf]--;
+    }
+    // after the entry is gone, a miss that walked the old one cannot fill the TLB past the invalidation
+    tlb_invalidate(slot, page);
+}
+
+// replace the entry of a present or reserved page, the TLB is invalidated after the new entry is in place
+void pte_update(int slot, int page, page_table_entry pte){
+    *pte_lookup(slot, page) = pte;
+    tlb_invalidate(slot, page);
+}
+
+// present and reserved pages of the process in slot in ascending order, with their entries, returns how many
+int collect_mapped_pages(int slot, int* pages, page_table_entry* ptes){
+    int count = 0;
+    if(page_table_backend == PT_HASHED){
+        // the process's entries come in insertion order, sort them through a bitmap of its pages
+        uint64_t mapped[(NUM_PAGES + 63) / 64] = {0};
+        page_table_entry by_page[NUM_PAGES];
+        pthread_mutex_lock(&hashed_pt_lock);
+        for(int idx=proc_hashed_head[slot]; idx!=-1; idx=hashed_ptes[idx].proc_next){
+            if(is_mapped(hashed_ptes[idx].pte)){
+                mapped[hashed_ptes[idx].page / 64] |= (uint64_t)1 << (hashed_ptes[idx].page % 64);
+                by_page[hashed_ptes[idx].page] = hashed_ptes[idx].pte;
+            }
+        }
+        pthread_mutex_unlock(&hashed_pt_lock);
+        for(int w=0; w<(NUM_PAGES + 63) / 64; w++){
+            for(uint64_t bits=mapped[w]; bits!=0; bits&=bits-1){
+                int page = w*64 + __builtin_ctzll(bits);
+                pages[count] = page;
+                ptes[count++] = by_page[page];
+            }
+        }
+        return count;
+    }
+    struct PCB* pcb = pcb_at(slot);
+    // directory entries without a second level table are skipped whole
+    for(int d=0; d<PT_DIR_ENTRIES; d++){
+        int leaf = pcb->page_dir[d];
+        if(leaf == PT_NO_LEAF){
+            continue;
+        }
+        page_table_entry* table = &page_table_pool[(long)leaf << PT_LEAF_SHIFT];
+        int left = page_table_used[leaf];
+        for(int i=0; i<PT_LEAF_ENTRIES && left > 0; i++){
+            if(is_mapped(table[i])){
+                pages[count] = (d << PT_LEAF_SHIFT) + i;
+                ptes[count++] = table[i];
+                left--;
+            }
+        }
+    }
+    return count;
+}
+
+// map num_pages pages starting at first_page with the given flags, taking frames from the extents in order
+// ext_index/ext_offset track how far into the extents we are
+// if src is not NULL the pages are filled from it with one memcpy per extent, returns src moved past the copied bytes
+unsigned char* map_pages_from_extents(int slot, int first_page, int num_pages, int flags,
+                                      struct frame_extent* extents, int* ext_index, int* ext_offset, unsigned char* src)
+{
+    while(num_pages > 0){
+        struct frame_extent* ext = &extents[*ext_index];
+        int take = ext->length - *ext_offset;
+        if(take > num_pages){
+            take = num_pages;
+        }
+        int first_frame = ext->start_frame + *ext_offset;
+        for(int j=0; j<take; j++){
+            frame_ref(first_frame + j) = 1;
+            pte_install(slot, first_page + j, build_pte(first_frame + j, 1, flags));
+        }
+        if(src != NULL){
+            memcpy(frame_to_mem(first_frame), src, take*PAGE_SIZE);
+            src += take*PAGE_SIZE;
+        }
+        proc_rss[slot] += take;
+        first_page += take;
+        num_pages -= take;
+        *ext_offset += take;
+        if(*ext_offset == ext->length){
+            (*ext_index)++;
+            *ext_offset = 0;
+        }
+    }
+    return src;
+}
 
-// byte addressable memory
-unsigned char RAM[RAM_SIZE];  
+// map num_pages pages starting at first_page with the given flags but without frames, a page reads as the
+// zero page until its first write gives it a zeroed frame, see page_fault
+void map_pages_reserved(int slot, int first_page, int num_pages, int flags){
+    for(int i=0; i<num_pages; i++){
+        pte_install(slot, first_page + i, PTE_RESERVED | flags);
+    }
+}
 
+// take a free PCB slot off the stack, its page directory is empty, returns the slot or -1
+int claim_pcb(){
+    pthread_mutex_lock(&pcb_table_lock);
+    int slot = -1;
+    if(pcb_slots->free_count > 0){
+        slot = pcb_slots->free_slots[--pcb_slots->free_count];
+        proc_pid[slot] = ~proc_pid[slot];
+        proc_is_free[slot] = 0;
+        proc_rss[slot] = 0;
+        proc_mm[slot] = slot;
+        proc_lent[slot] = 0;
+    }
+    pthread_mutex_unlock(&pcb_table_lock);
+    return slot;
+}
 
-// OS's memory starts at the beginning of RAM.
-// Store the process related info, page tables or other data structures here.
-// do not use more than (OS_MEM_SIZE: 72 MB).
-unsigned char* OS_MEM = RAM;  
+// put the slot back on the free stack under the next generation, which invalidates the old pid
+void release_pcb(int slot){
+    // hashed entries go first, the slot must not be handed out again while it still owns any
+    if(page_table_backend == PT_HASHED){
+        pthread_mutex_lock(&hashed_pt_lock);
+        while(proc_hashed_head[slot] != -1){
+            hashed_remove(proc_hashed_head[slot]);
+        }
+        pthread_mutex_unlock(&hashed_pt_lock);
+    }
+    pthread_mutex_lock(&pcb_table_lock);
+    struct PCB* pcb = pcb_at(slot);
+    int generation = ((proc_pid[slot] >> PID_SLOT_BITS) + 1) & PID_MAX_GENERATION;
+    proc_pid[slot] = ~((generation << PID_SLOT_BITS) | slot);
+    proc_is_free[slot] = 1;
+    // its TLB entries become unreachable with the ASID, the slot's next process gets a fresh one
+    tlb_release_asid(slot);
+    // second level tables still in the directory go back to the pool, their entries need not be cleared
+    for(int d=0; d<PT_DIR_ENTRIES; d++){
+        if(pcb->page_dir[d] != PT_NO_LEAF){
+            page_table_slots->free_tables[page_table_slots->free_count++] = pcb->page_dir[d];
+            pcb->page_dir[d] = PT_NO_LEAF;
+        }
+    }
+    pcb_slots->free_slots[pcb_slots->free_count++] = slot;
+    pthread_mutex_unlock(&pcb_table_lock);
+}
 
-// memory that can be used by processes.   
-// 128 MB size (RAM_SIZE - OS_MEM_SIZE)
-unsigned char* PS_MEM = RAM + OS_MEM_SIZE; 
+// slot of a live process, or -1 if the pid is stale or was never handed out
+// a free slot holds the complement of its next pid, which never equals a valid pid, so one compare covers both cases
+int pid_to_live_slot(int pid){
+    if(pid < 0 || pid_to_slot(pid) >= max_procs || proc_pid[pid_to_slot(pid)] != pid){
+        return -1;
+    }
+    return pid_to_slot(pid);
+}
 
+// slot whose page table serves the accesses of a live process, its own or the parent's while it is a
+// vfork child, -1 if there is no such process
+int pid_to_mm(int pid){
+    int slot = pid_to_live_slot(pid);
+    return slot == -1 ? -1 : proc_mm[slot];
+}
 
-// This first frame has frame number 0 and is located at start of RAM(NOT PS_MEM).
-// We also include the OS_MEM even though it is not paged. This is 
-// because the RAM can only be accessed through physical RAM addresses.  
-// The OS should ensure that it does not map any of the frames, that correspond
-// to its memory, to any process's page. 
-int NUM_FRAMES = ((RAM_SIZE) / PAGE_SIZE);
+// every change to the page table of the address space in slot, and to the frames it maps, is made with its
+// lock held: creating, forking, exec and exit, allocate_pages/deallocate_pages, page faults and pin_mem.
+// ksm_scan, the only code that rewrites the page tables of other processes, takes it for every page it looks at
+// a process's own memory accesses go through the TLB without it, see mm_access_begin
+void mm_lock(int slot){
+    pthread_mutex_lock(&proc_mm_lock[slot]);
+}
 
-// Actual number of usable frames by the processes.
-int NUM_USABLE_FRAMES = ((RAM_SIZE - OS_MEM_SIZE) / PAGE_SIZE);
+void mm_unlock(int slot){
+    pthread_mutex_unlock(&proc_mm_lock[slot]);
+}
 
-// To be set in case of errors. 
-int error_no; 
+// hold back new memory accesses to the address space in slot and wait for the ones in flight to finish,
+// its lock must be held. Undone by mm_resume.
+void mm_quiesce(int slot){
+    __atomic_fetch_or(&proc_mm_access[slot].state, MM_QUIESCE, __ATOMIC_ACQ_REL);
+    while(__atomic_load_n(&proc_mm_access[slot].state, __ATOMIC_ACQUIRE) != MM_QUIESCE){
+        sched_yield();
+    }
+}
 
-int pte_to_frame_num(page_table_entry pte);
-int get_flags(page_table_entry pte);
-page_table_entry build_pte(int page_num, int frame_num, int present, int flags);
+void mm_resume(int slot){
+    __atomic_fetch_and(&proc_mm_access[slot].state, ~MM_QUIESCE, __ATOMIC_RELEASE);
+}
 
-void os_init() {
-    // DONE student 
-    // initialize your data structures.
+// PCB of a live process, or NULL
+struct PCB* pid_to_pcb(int pid){
+    int slot = pid_to_live_slot(pid);
+    return slot == -1 ? NULL : pcb_at(slot);
+}
 
-    // first 32*1024 bytes are for the binary free list we created i.e. 32KB is  for the binary free list
-    // intitalise them all to 0 since nothing has been allocated yet
-    // storing the free list as a boolean array the size of total page_frames possible i.e.
-    unsigned char empty = 0;   
-    // 128*1024*1024/4*1024 = 32*1024 Bytes Needed = 32KB
-    // 0 means that the frame has not been allocated yet, 1 means frame allocated 
-    // to read from unsigned char array, read as (int)RAM[i]
-    int start_index_free_list = 0;
-    int end_index_free_list = ((RAM_SIZE - OS_MEM_SIZE) / PAGE_SIZE) - 1; //end_index has been filled,loop till <= end_index
-    for(int i=start_index_free_list; i<=end_index_free_list; i++){
-        RAM[i]  =  empty;
+// scan the hot metadata arrays only
+void print_process_stats(){
+    int live = 0;
+    long total_rss = 0;
+    int max_rss = 0;
+    for(int i=0; i<max_procs; i++){
+        if(!proc_is_free[i]){
+            live++;
+            total_rss += proc_rss[i];
+            max_rss = proc_rss[i] > max_rss ? proc_rss[i] : max_rss;
+        }
+    }
+    printf("Processes: %d / %d live, resident pages: %ld total, %d max\n", live, max_procs, total_rss, max_rss);
+}
+
+
+page_table_entry build_pte(int frame_num, int present, int flags){
+    // the zero page is the one frame in OS_MEM that processes map
+    if(frame_num!=0 && frame_num!=zero_frame && (frame_num>=NUM_FRAMES || frame_num<FIRST_USABLE_FRAME)){
+        printf("Error : page frame number out of range \n");
+    }
+    if(present!=0 && present!=1){
+        printf("Error : present bit can only be 0 or 1 \n");
     }
-    for(int i=0; i<100; i++){
-        struct PCB* temp = (struct PCB*) ( &OS_MEM[start_index_page_tables + 4108*i]);
-        temp->is_free = 1;
-        temp->pid = i; 
-        temp->page_table_count = 0;
-        for(int j=0; j<1024; j++){
-            // printf("Setting value as %d\n", build_pte(0, 0, 0, 0));
-            temp->page_table[j] = build_pte(0, 0, 0, 0);
-            // printf("Set value is %d\n", temp->page_table[i]);
+    if(flags>7 || flags<0){
+        printf("Error : flags can range from 0 to 7 \n");
+    }
+    return ((page_table_entry) frame_num << PTE_FRAME_SHIFT) | (present ? PTE_PRESENT : 0) | flags;
+}
+
+// hash of a page of memory, four independent lanes so that the multiplies overlap
+uint64_t page_hash(const unsigned char* mem){
+    const uint64_t* words = (const uint64_t*) mem;
+    uint64_t h[4] = {1, 2, 3, 4};
+    for(int i=0; i<PAGE_SIZE / 8; i+=4){
+        for(int lane=0; lane<4; lane++){
+            h[lane] = (h[lane] ^ words[i + lane]) * 0x9e3779b97f4a7c15ULL;
         }
-        // if(i==32){
-        //     temp->is_free = 1;
-        // }
+    }
+    return h[0] ^ (h[1] >> 7) ^ (h[2] << 13) ^ (h[3] >> 29);
+}
+
+// ------------------------------- image cache ------------------------------ //
+
+// hash of the num_pages pages of an image at mem, page order included
+uint64_t image_hash(const unsigned char* mem, int num_pages){
+    uint64_t hash = num_pages;
+    for(int i=0; i<num_pages; i++){
+        hash = (hash ^ page_hash(mem + (long)i * PAGE_SIZE)) * 0xff51afd7ed558ccdULL;
+    }
+    return hash;
+}
+
+void image_put(int* frames, int num_frames){
+    for(int i=0; i<num_frames; i++){
+        frame_put(frames[i]);
     }
 }
 
-int get_free_page(page_table_entry page_table[1024]){
-    for(int i=0; i<1024; i++){
-        if(is_present(page_table[i])==0){
-            return i;
+// drop the cache's references to an entry's frames and free the entry, image_cache_lock must be held
+void image_evict(struct image_entry* entry){
+    image_put(entry->frames, entry->code_pages + entry->ro_pages);
+    entry->src = NULL;
+}
+
+// look up the code + ro_data image at src, on a hit frames gets its frames with a reference taken for the
+// caller and 1 is returned. The hash of src is compared with the one taken when the image was loaded, so a
+// buffer that changed since is a miss; this reads src once and none of the cached frames.
+int image_lookup(const unsigned char* src, int code_pages, int ro_pages, int* frames){
+    int num_frames = code_pages + ro_pages;
+    if(!use_image_cache || num_frames == 0){
+        return 0;
+    }
+    uint64_t hash = image_hash(src, num_frames);
+    pthread_mutex_lock(&image_cache_lock);
+    struct image_entry* entry = NULL;
+    for(int i=0; i<IMAGE_CACHE_ENTRIES && entry == NULL; i++){
+        if(image_cache[i].src == src && image_cache[i].code_pages == code_pages && image_cache[i].ro_pages == ro_pages &&
+           image_cache[i].hash == hash){
+            entry = &image_cache[i];
         }
     }
-    return -1;
-} 
+    if(entry != NULL){
+        entry->last_used = ++image_clock;
+        for(int i=0; i<num_frames; i++){
+            frames[i] = entry->frames[i];
+            frame_get(frames[i]);
+        }
+    }
+    pthread_mutex_unlock(&image_cache_lock);
+    int hit = entry != NULL;
+    __atomic_add_fetch(hit ? &image_hits : &image_misses, 1, __ATOMIC_SEQ_CST);
+    return hit;
+}
 
-int get_free_page_frame_index(){
-    // storing the free list as a boolean array the size of total page_frames possible i.e.
-    // 128*1024*1024/4*1024 = 32*1024 Bytes Needed = 32KB
-    // 0 means that the frame has not been allocated yet, 1 means frame allocated 
-    // to read from unsigned char array, read as (int)RAM[i]
-    int start_index_free_list = 0;
-    int end_index_free_list = ((RAM_SIZE - OS_MEM_SIZE) / PAGE_SIZE) - 1; //end_index has been filled,loop till <= end_index
-    for(int i=start_index_free_list; i<=end_index_free_list; i++){
-        if((int)RAM[i]==0){
-            // printf("%d is free\n", 18432 + i);
-            return 18432 + i;
-        }else{
-            // printf("%d is used\n", 18432 + i);
+// remember the code + ro_data frames that create_ps just loaded from src into the process in slot,
+// an older image of the same key or the least recently used entry makes room
+void image_insert(const unsigned char* src, int code_pages, int ro_pages, int slot){
+    int num_frames = code_pages + ro_pages;
+    if(!use_image_cache || num_frames == 0){
+        return;
+    }
+    // the frames were just loaded from src, hashing it gives the hash of their contents
+    uint64_t hash = image_hash(src, num_frames);
+    pthread_mutex_lock(&image_cache_lock);
+    struct image_entry* victim = &image_cache[0];
+    for(int i=0; i<IMAGE_CACHE_ENTRIES; i++){
+        struct image_entry* entry = &image_cache[i];
+        if(entry->src == src && entry->code_pages == code_pages && entry->ro_pages == ro_pages){
+            victim = entry;
+            break;
+        }
+        if(victim->src != NULL && (entry->src == NULL || entry->last_used < victim->last_used)){
+            victim = entry;
         }
     }
-    return -1;
-} 
+    if(victim->src != NULL){
+        image_evict(victim);
+    }
+    victim->src = src;
+    victim->code_pages = code_pages;
+    victim->ro_pages = ro_pages;
+    victim->hash = hash;
+    victim->last_used = ++image_clock;
+    for(int i=0; i<num_frames; i++){
+        victim->frames[i] = pte_to_frame_num(pte_get(slot, i));
+        frame_get(victim->frames[i]);
+    }
+    pthread_mutex_unlock(&image_cache_lock);
+}
 
-int get_free_pcb_index(){
-    struct PCB* iter = (struct PCB*) ( &OS_MEM[start_index_page_tables]);
-    for(int i=0; i<100; i++){
-        // int pid = iter->pid;
-        // int ptc = iter->page_table_count;
-        // int is_free = iter->is_free;
-        // printf("%d, %d, %d, %d \n", i, is_free , pid, ptc);
-        if(iter->is_free){
-            return i;
+// evict every image whose frames are only held by the cache, returns how many were evicted
+int image_cache_shrink(){
+    int evicted = 0;
+    pthread_mutex_lock(&image_cache_lock);
+    for(int i=0; i<IMAGE_CACHE_ENTRIES; i++){
+        struct image_entry* entry = &image_cache[i];
+        if(entry->src != NULL && __atomic_load_n(&frame_ref(entry->frames[0]), __ATOMIC_SEQ_CST) == 1){
+            image_evict(entry);
+            evicted++;
         }
-        iter++;
     }
-    return -1;
-} 
+    pthread_mutex_unlock(&image_cache_lock);
+    return evicted;
+}
 
 
-page_table_entry build_pte(int page_num, int frame_num, int present, int flags){
-    if(page_num>1023 || page_num<0){
-        printf("Error : page number out of range \n");
-    }
-    // if(frame_num!=0 && (frame_num>51199 || frame_num<18432)){
-    //     printf("Error : page frame number out of range \n");
-    // }
-    if(present!=0 && present!=1){
-        printf("Error : present bit can only be 0 or 1 \n");
+
+
+
+// ------------------------------- same page merging ------------------------------ //
+
+// hash of a frame's contents
+uint64_t frame_hash(int frame){
+    return page_hash(frame_to_mem(frame));
+}
+
+// entry of the table holding hash in the given state, or the free entry where it would go, NULL if the table is full
+struct ksm_entry* ksm_find(uint64_t hash, int state){
+    for(int i=0; i<KSM_TABLE_SIZE; i++){
+        struct ksm_entry* entry = &ksm_table[(hash + i) & (KSM_TABLE_SIZE - 1)];
+        if(entry->state == KSM_FREE || (entry->hash == hash && entry->state == state)){
+            return entry;
+        }
     }
-    if(flags>7 || flags<0){
-        printf("Error : flags can range from 0 to 7 \n");
+    return NULL;
+}
+
+// point page of the process in slot, currently mapping the frame in pte, at the stable frame instead
+void ksm_merge(int slot, int page, page_table_entry pte, int stable_frame){
+    frame_get(stable_frame);
+    pte_update(slot, page, (pte & ~(PTE_FRAME_MASK | O_WRITE)) | ((page_table_entry) stable_frame << PTE_FRAME_SHIFT) | PTE_COW);
+    frame_put(pte_to_frame_num(pte));
+    ksm_counters.pages_merged++;
+}
+
+// free the entry at idx without leaving a hole in any probe sequence: later entries of the same run that
+// could live at idx move back into it, one after the other (Knuth's algorithm R for linear probing)
+void ksm_remove(int idx){
+    int j = idx;
+    for(;;){
+        j = (j + 1) & (KSM_TABLE_SIZE - 1);
+        if(ksm_table[j].state == KSM_FREE){
+            break;
+        }
+        // an entry whose home lies cyclically in (idx, j] is still found where it is
+        int home = ksm_table[j].hash & (KSM_TABLE_SIZE - 1);
+        if(idx <= j ? (idx < home && home <= j) : (idx < home || home <= j)){
+            continue;
+        }
+        ksm_table[idx] = ksm_table[j];
+        idx = j;
     }
-    // page_table_entry res = (page_num<<22) + (frame_num<<6) + (present<<3) + flags;
-    return (page_table_entry) ((page_num<<22) + (frame_num<<6) + (present<<3) + flags);
+    ksm_table[idx].state = KSM_FREE;
 }
 
+// end of a pass over all processes: unstable entries are forgotten and stable frames that no process maps
+// anymore are released, the table is compacted in place as they go
+void ksm_end_pass(){
+    for(int i=0; i<KSM_TABLE_SIZE; ){
+        struct ksm_entry* entry = &ksm_table[i];
+        if(entry->state == KSM_UNSTABLE || (entry->state == KSM_STABLE && frame_ref(entry->frame) == 1)){
+            if(entry->state == KSM_STABLE){
+                frame_put(entry->frame);
+            }
+            // an entry from further on may have moved into i, it is looked at next
+            ksm_remove(i);
+        }else{
+            i++;
+        }
+    }
+    ksm_counters.full_scans++;
+}
 
+// look at one page of the process in slot for ksm_scan, whose address space lock is held and quiesced
+// returns -1 if the page is not present, 1 if it was merged and 0 otherwise
+int ksm_scan_page(int slot, int page){
+    page_table_entry* entry = pte_lookup(slot, page);
+    if(entry == NULL || !is_present(*entry)){
+        return -1;
+    }
+    page_table_entry pte = *entry;
+    int frame = pte_to_frame_num(pte);
+    // pages shared by spawn_ps must see each other's writes, they are never merged
+    if(!is_writeable(pte) || (pte & PTE_SHARED) || frame_ref(frame) != 1){
+        return 0;
+    }
+    uint64_t hash = frame_hash(frame);
+    struct ksm_entry* stable = ksm_find(hash, KSM_STABLE);
+    if(stable != NULL && stable->state == KSM_STABLE){
+        if(memcmp(frame_to_mem(stable->frame), frame_to_mem(frame), PAGE_SIZE) == 0){
+            ksm_merge(slot, page, pte, stable->frame);
+            return 1;
+        }
+        return 0;
+    }
+    struct ksm_entry* unstable = ksm_find(hash, KSM_UNSTABLE);
+    if(unstable == NULL){
+        return 0;
+    }
+    if(unstable->state == KSM_UNSTABLE){
+        // the candidate may have been written, remapped or freed since it was seen. Its owner's lock is only
+        // tried, waiting for it while holding this one could deadlock with fork_ps or spawn_ps, a busy owner
+        // keeps its candidate for a later page
+        int owner = pid_to_live_slot(unstable->pid);
+        int locked = owner != -1 && (owner == slot || pthread_mutex_trylock(&proc_mm_lock[owner]) == 0);
+        if(owner != -1 && !locked){
+            return 0;
+        }
+        if(locked && owner != slot){
+            mm_quiesce(owner);
+        }
+        if(locked){
+            page_table_entry owner_pte = proc_pid[owner] == unstable->pid ? pte_get(owner, unstable->page) : 0;
+            int merge = is_present(owner_pte) && is_writeable(owner_pte) && pte_to_frame_num(owner_pte) == unstable->frame &&
+                        frame_ref(unstable->frame) == 1 && !(owner == slot && unstable->page == page) &&
+                        memcmp(frame_to_mem(unstable->frame), frame_to_mem(frame), PAGE_SIZE) == 0;
+            if(merge){
+                // the candidate's frame becomes the stable frame, its owner loses write access to it too
+                pte_update(owner, unstable->page, (owner_pte & ~(page_table_entry) O_WRITE) | PTE_COW);
+                // the entry turns stable in place, it stays where lookups for the hash find it
+                frame_get(unstable->frame);
+                *unstable = (struct ksm_entry){hash, unstable->frame, KSM_STABLE, -1, -1};
+                ksm_merge(slot, page, pte, unstable->frame);
+            }
+            if(owner != slot){
+                mm_resume(owner);
+                mm_unlock(owner);
+            }
+            if(merge){
+                return 1;
+            }
+        }
+    }
+    *unstable = (struct ksm_entry){hash, frame, KSM_UNSTABLE, proc_pid[slot], page};
+    return 0;
+}
 
+// Look at up to max_pages present pages, continuing where the last call stopped, and merge writable pages
+// whose contents are identical into one frame shared copy on write, so the first write to a merged page
+// gets a private copy again (cow_break). A page whose frame is pinned or already shared is left alone.
+// Like KSM a page is compared against the merged frames first, then against the candidates seen earlier in
+// the same pass. Every page is looked at with the address space lock of its process held, so page table
+// changes of the process (exit_ps, fork_ps, deallocate_pages, faults...) wait for it and the other way round,
+// and with the address space quiesced: memory accesses in flight finish first and new ones wait, so no write
+// through a translation taken before a merge reaches the old frame. One thread scans at a time, a call made
+// while another thread is scanning returns 0 right away.
+// Returns the number of pages merged.
+int ksm_scan(int max_pages){
+    if(pthread_mutex_trylock(&ksm_lock) != 0){
+        return 0;
+    }
+    double start = now_ns();
+    int merged = 0;
+    int scanned = 0;
+    while(scanned < max_pages){
+        if(ksm_cursor_page == NUM_PAGES){
+            ksm_cursor_page = 0;
+            ksm_cursor_slot++;
+        }
+        if(ksm_cursor_slot == max_procs){
+            ksm_end_pass();
+            ksm_cursor_slot = 0;
+            int empty = ksm_pass_pages == 0;
+            ksm_pass_pages = 0;
+            if(empty){
+                break;
+            }
+        }
+        int slot = ksm_cursor_slot;
+        if(proc_is_free[slot]){
+            ksm_cursor_page = NUM_PAGES;
+            continue;
+        }
+        int page = ksm_cursor_page++;
+        // the process may have exited before the lock was taken
+        mm_lock(slot);
+        int result = -1;
+        if(!proc_is_free[slot]){
+            mm_quiesce(slot);
+            result = ksm_scan_page(slot, page);
+            mm_resume(slot);
+        }
+        mm_unlock(slot);
+        if(result == -1){
+            continue;
+        }
+        scanned++;
+        ksm_pass_pages++;
+        merged += result;
+    }
+    ksm_counters.pages_scanned += scanned;
+    ksm_counters.scan_ns += now_ns() - start;
+    pthread_mutex_unlock(&ksm_lock);
+    return merged;
+}
 
+void print_ksm_stats(){
+    // pages_shared counts merged frames in use, pages_sharing the page table entries beyond the first
+    // that map one of them, that is the frames merging saved
+    long pages_shared = 0;
+    long pages_sharing = 0;
+    pthread_mutex_lock(&ksm_lock);
+    for(int i=0; i<KSM_TABLE_SIZE; i++){
+        if(ksm_table[i].state == KSM_STABLE && frame_ref(ksm_table[i].frame) > 1){
+            pages_shared++;
+            pages_sharing += frame_ref(ksm_table[i].frame) - 2;
+        }
+    }
+    struct ksm_counters c = ksm_counters;
+    pthread_mutex_unlock(&ksm_lock);
+    printf("KSM: %ld pages shared, %ld pages sharing (%.1f MB saved), %lld pages scanned, %lld full scans, %.2f ms scanning\n",
+            pages_shared, pages_sharing, (double) pages_sharing * PAGE_SIZE / MB, c.pages_scanned, c.full_scans, c.scan_ns / 1e6);
+}
 
 // ----------------------------------- Functions for managing memory --------------------------------- //
 
@@ -191,79 +2272,90 @@ int create_ps(int code_size, int ro_data_size, int rw_data_size,
                  int max_stack_size, unsigned char* code_and_ro_data) 
 {   
     // DONE student
-    unsigned char allocated = 1;
-    int pcb_index_to_allocate = get_free_pcb_index();
+    int slot = claim_pcb();
+    if(slot == -1){
+        printf("Error : no free space \n");
+        return -1;
+    }
+    mm_lock(slot);
+    if(load_image(slot, code_size, ro_data_size, rw_data_size, max_stack_size, code_and_ro_data) == -1){
+        release_pcb(slot);
+        mm_unlock(slot);
+        return -1;
+    }
+    mm_unlock(slot);
+    return proc_pid[slot];
+}
+
+// set up the layout described above in the empty address space of the process in slot, for create_ps and exec_ps
+// returns 0, or -1 with nothing mapped if the image does not fit
+int load_image(int slot, int code_size, int ro_data_size, int rw_data_size,
+               int max_stack_size, unsigned char* code_and_ro_data)
+{
     int no_pages_code = code_size/PAGE_SIZE;
     int no_pages_ro_data = ro_data_size/PAGE_SIZE;
     int no_pages_rw_data = rw_data_size/PAGE_SIZE;
     int no_pages_stack = max_stack_size/PAGE_SIZE;
-    if(pcb_index_to_allocate==-1 || (no_pages_code + no_pages_ro_data + no_pages_rw_data + no_pages_stack > 1024)){
+    int num_pages = no_pages_code + no_pages_ro_data + no_pages_rw_data + no_pages_stack;
+    int image_pages = no_pages_code + no_pages_ro_data;
+    // with demand paging rw_data and the stack only take frames once they are touched
+    int lazy_pages = use_demand_paging ? no_pages_rw_data + no_pages_stack : 0;
+    // code and ro_data loaded by an earlier create_ps from the same bytes are shared instead of copied
+    int image_frames[NUM_PAGES];
+    int shared = num_pages <= NUM_PAGES && image_lookup(code_and_ro_data, no_pages_code, no_pages_ro_data, image_frames);
+    int new_frames = (shared ? num_pages - image_pages : num_pages) - lazy_pages;
+    // reject anything that cannot be satisfied before touching the page table
+    if(num_pages > NUM_PAGES || reserve_frames(new_frames) == -1){
+        image_put(image_frames, shared ? image_pages : 0);
         printf("Error : no free space \n");
-        // return -1;
-    }
-    struct PCB* curr = (struct PCB*) ( &OS_MEM[start_index_page_tables+ 4108*pcb_index_to_allocate]);
-    curr->is_free = 0;
-    int process_id_allocated = curr->pid;
-    for(int i=0; i<no_pages_code; i++){
-        int page_to_allocate = i;
-        // printf("ALLOCATING PAGE %d\n", page_to_allocate);
-        if(page_to_allocate==-1){
-            printf("Error : no page available to allocate in  virt mem");
-        }
-        int page_frame_to_allocate = get_free_page_frame_index();
-        // printf("free page frame is %d\n", page_frame_to_allocate);
-        RAM[(page_frame_to_allocate-18432)]=allocated;
-        // printf("Setting value as %d\n", build_pte(page_to_allocate, page_frame_to_allocate, 1, 5));
-        curr->page_table[page_to_allocate] = build_pte(page_to_allocate, page_frame_to_allocate, 1, 5);
-        // printf("Set value is %d\n", curr->page_table[page_to_allocate]);
-        // RAM[(page_frame_to_allocate)*4*1024] to RAM[((page_frame_to_allocate)+1)*4*1024 - 1] to be filled now
-        memcpy(OS_MEM + (page_frame_to_allocate)*4*1024, code_and_ro_data, 4*1024);
-        code_and_ro_data+=4096;
-        curr->page_table_count++;
-    }
-    for(int i=0; i<no_pages_ro_data; i++){
-        int page_to_allocate = no_pages_code + i;
-        if(page_to_allocate==-1){
-            printf("Error : no page available to allocate in  virt mem");
-        }
-        int page_frame_to_allocate = get_free_page_frame_index();
-        // printf("free page frame is %d\n", page_frame_to_allocate);
-        RAM[(page_frame_to_allocate-18432)]=allocated;
-        // printf("Setting value as %d\n", build_pte(page_to_allocate, page_frame_to_allocate, 1, 1));
-        curr->page_table[page_to_allocate]=build_pte(page_to_allocate, page_frame_to_allocate, 1, 1);
-        // printf("Set value is %d\n", curr->page_table[page_to_allocate]);
-        // RAM[(page_frame_to_allocate)*4*1024] to RAM[((page_frame_to_allocate)+1)*4*1024 - 1] to be filled now
-        memcpy(OS_MEM + (page_frame_to_allocate)*4*1024, code_and_ro_data, 4*1024);
-        code_and_ro_data+=4096;
-        curr->page_table_count++;
-    }
-    for(int i=0; i<no_pages_rw_data; i++){
-        int page_to_allocate = no_pages_code + no_pages_ro_data + i;
-        if(page_to_allocate==-1){
-            printf("Error : no page available to allocate in  virt mem");
-        }
-        int page_frame_to_allocate = get_free_page_frame_index();
-        // printf("free page frame is %d\n", page_frame_to_allocate);
-        RAM[(page_frame_to_allocate-18432)]=allocated;
-        // printf("Setting value as %d\n", build_pte(page_to_allocate, page_frame_to_allocate, 1, 3));
-        curr->page_table[page_to_allocate]=build_pte(page_to_allocate, page_frame_to_allocate, 1, 3);
-        // printf("Set value is %d\n", curr->page_table[page_to_allocate]);
-        curr->page_table_count++;
-    }
-    for(int i=0; i<no_pages_stack; i++){
-        int page_to_allocate = 1023 - no_pages_stack + i + 1;
-        if(page_to_allocate==-1){
-            printf("Error : no page available to allocate in  virt mem");
-        }
-        int page_frame_to_allocate = get_free_page_frame_index();
-        // printf("free page frame is %d\n", page_frame_to_allocate);
-        RAM[(page_frame_to_allocate-18432)]=allocated;
-        // printf("Setting value as %d\n", build_pte(page_to_allocate, page_frame_to_allocate, 1, 3));
-        curr->page_table[page_to_allocate]=build_pte(page_to_allocate, page_frame_to_allocate, 1, 3);
-        // printf("Set value is %d\n", curr->page_table[page_to_allocate]);
-        curr->page_table_count++;
+        return -1;
     }
-    return process_id_allocated;
+    // second level tables for the code to rw_data range and for the stack
+    if(map_page_tables(slot, 0, num_pages - no_pages_stack) == -1 ||
+       map_page_tables(slot, NUM_PAGES - no_pages_stack, no_pages_stack) == -1){
+        unreserve_frames(new_frames);
+        image_put(image_frames, shared ? image_pages : 0);
+        unmap_page_tables(slot, 0, NUM_PAGES);
+        printf("Error : no free space \n");
+        return -1;
+    }
+    // all new frames for the process come from one batch allocation as a few contiguous extents
+    struct frame_extent extents[NUM_PAGES];
+    if(alloc_frames(new_frames, extents) == -1){
+        image_put(image_frames, shared ? image_pages : 0);
+        unmap_page_tables(slot, 0, NUM_PAGES);
+        printf("Error : no free space \n");
+        return -1;
+    }
+    proc_segments[slot] = (struct proc_segments){
+        no_pages_code, no_pages_code + no_pages_ro_data,
+        no_pages_code + no_pages_ro_data + no_pages_rw_data, NUM_PAGES - no_pages_stack
+    };
+    int ext_index = 0;
+    int ext_offset = 0;
+    // code is read + execute, ro_data is read only, both are copied from code_and_ro_data one extent at a time
+    if(shared){
+        for(int i=0; i<image_pages; i++){
+            pte_install(slot, i, build_pte(image_frames[i], 1, i < no_pages_code ? O_READ | O_EX : O_READ));
+        }
+        proc_rss[slot] += image_pages;
+    }else{
+        map_pages_from_extents(slot, 0, no_pages_code, O_READ | O_EX, extents, &ext_index, &ext_offset, code_and_ro_data);
+        map_pages_from_extents(slot, no_pages_code, no_pages_ro_data, O_READ, extents, &ext_index, &ext_offset,
+                               code_and_ro_data + (long)no_pages_code * PAGE_SIZE);
+        image_insert(code_and_ro_data, no_pages_code, no_pages_ro_data, slot);
+    }
+    // rw_data and stack are read + write, stack sits at the top of virtual memory
+    if(use_demand_paging){
+        map_pages_reserved(slot, image_pages, no_pages_rw_data, O_READ | O_WRITE);
+        map_pages_reserved(slot, NUM_PAGES - no_pages_stack, no_pages_stack, O_READ | O_WRITE);
+    }else{
+        map_pages_from_extents(slot, image_pages, no_pages_rw_data, O_READ | O_WRITE,
+                               extents, &ext_index, &ext_offset, NULL);
+        map_pages_from_extents(slot, NUM_PAGES - no_pages_stack, no_pages_stack, O_READ | O_WRITE,
+                               extents, &ext_index, &ext_offset, NULL);
+    }
+    return 0;
 }
 
 /**
@@ -273,18 +2365,57 @@ int create_ps(int code_size, int ro_data_size, int rw_data_size,
 void exit_ps(int pid) 
 {
    // DONE student
-   unsigned char empty = 0;
-   struct PCB* curr = (struct PCB*) ( &OS_MEM[start_index_page_tables+ 4108*pid]);
-   curr->is_free = 1;
-    for(int i=0; i<1024; i++){
-        if(is_present(curr->page_table[i])){
-            int frame_number_to_drop = pte_to_frame_num(curr->page_table[i]);
-            RAM[frame_number_to_drop - 18432] = empty;
-            curr->page_table[i] = build_pte(0, 0, 0, 0);
+   struct PCB* curr = pid_to_pcb(pid);
+   if(curr == NULL){
+       return;
+   }
+    int slot = pid_to_slot(pid);
+    int mm = proc_mm[slot];
+    mm_lock(mm);
+    // a concurrent exit_ps may have got there first, or a vfork child got its own address space with exec_ps
+    if(proc_pid[slot] != pid){
+        mm_unlock(mm);
+        return;
+    }
+    if(proc_mm[slot] != mm){
+        mm_unlock(mm);
+        exit_ps(pid);
+        return;
+    }
+    // vfork children still borrowing the address space have nothing left to run in, they go first
+    for(int i=0; proc_lent[slot] > 0 && i<max_procs; i++){
+        if(i != slot && !proc_is_free[i] && proc_mm[i] == slot){
+            exit_ps(proc_pid[i]);
+        }
+    }
+    // a vfork child has no mappings of its own, it only hands the borrowed address space back
+    if(proc_mm[slot] != slot){
+        proc_lent[proc_mm[slot]]--;
+    }
+    // marked as going away before any frame is dropped, so that pin_mem cannot take a frame from it
+    // that is already on its way to another process
+    __atomic_store_n(&proc_is_free[pid_to_slot(pid)], 1, __ATOMIC_SEQ_CST);
+    // no translation of the process may outlive its frames: the ASID goes first, which makes its TLB entries
+    // unreachable and keeps misses from filling new ones, then the entries are cleared (without a TLB
+    // invalidation each, there is no ASID left to look for) and only then are the frames dropped.
+    // Only existing entries are walked, pinned frames stay around until they are unpinned, reserved pages
+    // have no frame to drop
+    tlb_release_asid(slot);
+    int pages[NUM_PAGES];
+    page_table_entry ptes[NUM_PAGES];
+    int count = collect_mapped_pages(slot, pages, ptes);
+    for(int i=0; i<count; i++){
+        pte_clear(slot, pages[i]);
+    }
+    for(int i=0; i<count; i++){
+        if(is_present(ptes[i])){
+            frame_put(pte_to_frame_num(ptes[i]));
         }
-        // printf("Set value is %d\n", temp->page_table[i]);
     }
-   curr->page_table_count = 0;
+   proc_rss[pid_to_slot(pid)] = 0;
+   // the PCB can only be reused once its page table is clear
+   release_pcb(pid_to_slot(pid));
+   mm_unlock(mm);
 }
 
 
@@ -293,40 +2424,403 @@ void exit_ps(int pid)
  * Create a new process that is identical to the process with given pid. 
  * 
  */
+
 int fork_ps(int pid) {
-    unsigned char allocated = 1;
-    int pcb_index_to_allocate = get_free_pcb_index();
-    struct PCB* to_cpy = (struct PCB*) ( &OS_MEM[start_index_page_tables+ 4108*pid]);
+    struct PCB* to_cpy = pid_to_pcb(pid);
+    if(to_cpy == NULL){
+        printf("Error : no such process \n");
+        return -1;
+    }
+    // the parent's page table stays as it is while the child is built from it
+    int parent = pid_to_mm(pid);
+    mm_lock(parent);
+    // collect the pages to copy so that the child gets all its frames in one batch
+    int pages[NUM_PAGES];
+    page_table_entry ptes[NUM_PAGES];
+    int pages_left = collect_mapped_pages(parent, pages, ptes);
+    int child_pid = use_cow_fork ? fork_cow(pid, pages, ptes, pages_left) : fork_copy(pid, pages, ptes, pages_left);
+    mm_unlock(parent);
+    return child_pid;
+}
+
+// fork_ps copying every page of the parent into new frames of the child right away
+int fork_copy(int pid, int* pages, page_table_entry* ptes, int pages_left){
+    // reserved pages of the parent stay reserved in the child and pages on the zero page stay there,
+    // only the other present ones need a frame
+    int frames_needed = 0;
+    for(int i=0; i<pages_left; i++){
+        frames_needed += is_present(ptes[i]) && pte_to_frame_num(ptes[i]) != zero_frame;
+    }
+    if(reserve_frames(frames_needed) == -1){
+        printf("Error : no free space \n");
+        return -1;
+    }
+    int pcb_index_to_allocate = claim_pcb();
     if(pcb_index_to_allocate==-1){
+        unreserve_frames(frames_needed);
+        printf("Error : no free space \n");
+        return -1;
+    }
+    int slot = pcb_index_to_allocate;
+    mm_lock(slot);
+    // page table storage for every run of consecutive mapped pages of the parent
+    for(int i=0, run; i<pages_left; i+=run){
+        for(run=1; i+run<pages_left && pages[i+run] == pages[i] + run; run++);
+        if(map_page_tables(slot, pages[i], run) == -1){
+            unreserve_frames(frames_needed);
+            release_pcb(slot);
+            mm_unlock(slot);
+            printf("Error : no free space \n");
+            return -1;
+        }
+    }
+    struct frame_extent extents[NUM_PAGES];
+    if(alloc_frames(frames_needed, extents) == -1){
+        release_pcb(slot);
+        mm_unlock(slot);
+        printf("Error : no free space \n");
+        return -1;
+    }
+    int process_id_allocated = proc_pid[slot];
+    proc_segments[slot] = proc_segments[pid_to_slot(pid)];
+    int ext_index = 0;
+    int ext_offset = 0;
+    // pages whose parent frames and child frames are both contiguous are copied with one memcpy
+    int copy_dst = -1;
+    int copy_src = -1;
+    int copy_len = 0;
+    for(int i=0; i<pages_left; i++){
+        page_table_entry pte = ptes[i];
+        if(!is_present(pte) || pte_to_frame_num(pte) == zero_frame){
+            pte_install(slot, pages[i], pte & ~(PTE_ACCESSED | PTE_DIRTY));
+            proc_rss[slot] += is_present(pte);
+            continue;
+        }
+        int page_frame_to_allocate = extents[ext_index].start_frame + ext_offset;
+        if(++ext_offset == extents[ext_index].length){
+            ext_index++;
+            ext_offset = 0;
+        }
+        frame_ref(page_frame_to_allocate) = 1;
+        // the copy is the child's own, a copy on write page gets its write permission back
+        pte_install(slot, pages[i], build_pte(page_frame_to_allocate, 1, get_flags(pte) | ((pte & PTE_COW) ? O_WRITE : 0)));
+        proc_rss[slot]++;
+        int parent_frame = pte_to_frame_num(pte);
+        if(copy_len > 0 && copy_dst + copy_len == page_frame_to_allocate && copy_src + copy_len == parent_frame){
+            copy_len++;
+            continue;
+        }
+        if(copy_len > 0){
+            memcpy(frame_to_mem(copy_dst), frame_to_mem(copy_src), copy_len*PAGE_SIZE);
+        }
+        copy_dst = page_frame_to_allocate;
+        copy_src = parent_frame;
+        copy_len = 1;
+    }
+    if(copy_len > 0){
+        memcpy(frame_to_mem(copy_dst), frame_to_mem(copy_src), copy_len*PAGE_SIZE);
+    }
+    mm_unlock(slot);
+    // DONE student:
+    return process_id_allocated;
+}
+
+
+// fork_ps sharing the parent's frames: read only pages are simply shared, writable ones become read only
+// copy on write pages in both processes (PTE_COW) until one of them writes, see cow_break
+// a writable page that is pinned (pin_mem) is copied for the child right away, the pinned frame has to
+// stay the parent's, and so is a spawn_ps region (PTE_SHARED), whose frame stays shared with the spawned child
+// fork_ps holds the parent's address space lock
+int fork_cow(int pid, int* pages, page_table_entry* ptes, int num_pages){
+    int parent = pid_to_mm(pid);
+    int slot = claim_pcb();
+    if(slot == -1){
+        printf("Error : no free space \n");
+        return -1;
+    }
+    mm_lock(slot);
+    for(int i=0, run; i<num_pages; i+=run){
+        for(run=1; i+run<num_pages && pages[i+run] == pages[i] + run; run++);
+        if(map_page_tables(slot, pages[i], run) == -1){
+            release_pcb(slot);
+            mm_unlock(slot);
+            printf("Error : no free space \n");
+            return -1;
+        }
+    }
+    int process_id_allocated = proc_pid[slot];
+    proc_segments[slot] = proc_segments[pid_to_slot(pid)];
+    for(int i=0; i<num_pages; i++){
+        page_table_entry pte = ptes[i];
+        if(!is_present(pte)){
+            pte_install(slot, pages[i], pte);
+            continue;
+        }
+        int frame = pte_to_frame_num(pte);
+        int pinned = 0;
+        if(is_writeable(pte)){
+            pinned = __atomic_load_n(&frame_pin_count(frame), __ATOMIC_SEQ_CST) > 0 || (pte & PTE_SHARED);
+            pte = (pte & ~(page_table_entry) O_WRITE) | PTE_COW;
+            if(!pinned){
+                pte_update(parent, pages[i], pte);
+            }
+        }
+        frame_get(frame);
+        pte_install(slot, pages[i], pte & ~(PTE_ACCESSED | PTE_DIRTY | PTE_SHARED));
+        proc_rss[slot]++;
+        if(pinned && cow_break(slot, pages[i]) == -1){
+            exit_ps(process_id_allocated);
+            mm_unlock(slot);
+            return -1;
+        }
+    }
+    mm_unlock(slot);
+    return process_id_allocated;
+}
+
+// give the process in slot its own writable copy of a copy on write page, the last process sharing a frame
+// takes it over without copying. Returns -1 if the page is not copy on write or no frame is free.
+// the address space lock of slot must be held
+int cow_break(int slot, int page){
+    page_table_entry* pte = pte_lookup(slot, page);
+    if(pte == NULL || !is_present(*pte) || !(*pte & PTE_COW)){
+        return -1;
+    }
+    int frame = pte_to_frame_num(*pte);
+    int flags = get_flags(*pte) | O_WRITE;
+    if(frame != zero_frame && __atomic_load_n(&frame_ref(frame), __ATOMIC_SEQ_CST) == 1){
+        pte_update(slot, page, build_pte(frame, 1, flags));
+        __atomic_add_fetch(&cow_reuses, 1, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    struct frame_extent extent;
+    if(reserve_frames(1) == -1 || alloc_frames(1, &extent) == -1){
+        printf("Error : no free space \n");
+        return -1;
+    }
+    // frames are handed out zeroed, a page on the zero page needs no copy
+    if(frame != zero_frame){
+        memcpy(frame_to_mem(extent.start_frame), frame_to_mem(frame), PAGE_SIZE);
+    }
+    frame_ref(extent.start_frame) = 1;
+    // the shared frame is only dropped once nothing can reach it through this process anymore
+    pte_update(slot, page, build_pte(extent.start_frame, 1, flags));
+    frame_put(frame);
+    __atomic_add_fetch(&cow_copies, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+// page fault handler, called for an access the page table does not allow: a read of a reserved page maps
+// the zero page, a write allocates its frame (frames are handed out zeroed), a write to a copy on write
+// page (the zero page included) is left to cow_break
+// returns 0 if the access can be retried, -1 if it is illegal or no frame is free
+int page_fault(int slot, int page, int access){
+    mm_lock(slot);
+    int result = handle_page_fault(slot, page, access);
+    mm_unlock(slot);
+    return result;
+}
+
+// page_fault with the address space lock of slot held
+int handle_page_fault(int slot, int page, int access){
+    page_table_entry* pte = pte_lookup(slot, page);
+    if(pte == NULL || !(*pte & PTE_RESERVED) || !(get_flags(*pte) & access)){
+        return access == O_WRITE ? cow_break(slot, page) : -1;
+    }
+    int flags = get_flags(*pte);
+    if(access != O_WRITE){
+        pte_update(slot, page, build_pte(zero_frame, 1, flags & ~O_WRITE) | ((flags & O_WRITE) ? PTE_COW : 0));
+        proc_rss[slot]++;
+        __atomic_add_fetch(&zero_page_maps, 1, __ATOMIC_SEQ_CST);
+        return 0;
+    }
+    struct frame_extent extent;
+    if(reserve_frames(1) == -1 || alloc_frames(1, &extent) == -1){
+        printf("Error : no free space \n");
+        return -1;
+    }
+    frame_ref(extent.start_frame) = 1;
+    pte_update(slot, page, build_pte(extent.start_frame, 1, flags));
+    proc_rss[slot]++;
+    __atomic_add_fetch(&demand_faults, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+
+// Create a child of the process with given pid that runs in the parent's address space: no page is copied
+// or shared copy on write, the child's accesses, allocations and deallocations go to the parent's page table
+// and both see each other's writes. The child gets its own address space with exec_ps, exiting the parent
+// kills the children still borrowing from it. Takes the same time whatever the size of the parent.
+int vfork_ps(int pid){
+    int parent = pid_to_mm(pid);
+    if(parent == -1){
+        printf("Error : no such process \n");
+        return -1;
+    }
+    // proc_lent of the address space is only changed with its lock held, the parent may have exited meanwhile
+    mm_lock(parent);
+    if(pid_to_mm(pid) != parent){
+        mm_unlock(parent);
+        printf("Error : no such process \n");
+        return -1;
+    }
+    int slot = claim_pcb();
+    if(slot == -1){
+        mm_unlock(parent);
         printf("Error : no free space \n");
+        return -1;
+    }
+    proc_mm[slot] = parent;
+    proc_lent[parent]++;
+    proc_segments[slot] = proc_segments[pid_to_slot(pid)];
+    int child_pid = proc_pid[slot];
+    mm_unlock(parent);
+    return child_pid;
+}
+
+// Replace the memory of the process with given pid by a new image laid out like create_ps does. A vfork
+// child stops borrowing its parent's address space and gets its own, any other process drops its mappings
+// first. Returns 0, or -1 if the image does not fit: a vfork child is left as it was, any other process
+// has lost its old memory and is killed. A process whose address space is lent to vfork children cannot exec.
+int exec_ps(int pid, int code_size, int ro_data_size, int rw_data_size,
+            int max_stack_size, unsigned char* code_and_ro_data)
+{
+    int slot = pid_to_live_slot(pid);
+    if(slot == -1){
+        printf("Error : no such process \n");
+        return -1;
+    }
+    // a vfork child holds the lock of the address space it borrows, that is where proc_lent is kept,
+    // and the lock of its own slot the new image goes into. Both are rechecked once held
+    int mm = proc_mm[slot];
+    mm_lock(mm);
+    if(mm != slot){
+        mm_lock(slot);
+    }
+    if(proc_pid[slot] != pid || proc_mm[slot] != mm){
+        if(mm != slot){
+            mm_unlock(slot);
+        }
+        mm_unlock(mm);
+        if(proc_pid[slot] != pid){
+            printf("Error : no such process \n");
+            return -1;
+        }
+        return exec_ps(pid, code_size, ro_data_size, rw_data_size, max_stack_size, code_and_ro_data);
+    }
+    if(proc_lent[slot] > 0){
+        if(mm != slot){
+            mm_unlock(slot);
+        }
+        mm_unlock(mm);
+        printf("Error : address space is in use by a vfork child \n");
+        return -1;
+    }
+    // the new image goes into the slot's own page table, a vfork child's is still empty
+    if(proc_mm[slot] == slot){
+        // the pte is cleared before the frame is dropped, as in deallocate_pages
+        int pages[NUM_PAGES];
+        page_table_entry ptes[NUM_PAGES];
+        int count = collect_mapped_pages(slot, pages, ptes);
+        for(int i=0; i<count; i++){
+            pte_clear(slot, pages[i]);
+            if(is_present(ptes[i])){
+                frame_put(pte_to_frame_num(ptes[i]));
+            }
+        }
+        proc_rss[slot] = 0;
+        unmap_page_tables(slot, 0, NUM_PAGES);
+    }
+    if(load_image(slot, code_size, ro_data_size, rw_data_size, max_stack_size, code_and_ro_data) == -1){
+        if(proc_mm[slot] == slot){
+            exit_ps(pid);
+        }
+        if(mm != slot){
+            mm_unlock(slot);
+        }
+        mm_unlock(mm);
+        return -1;
+    }
+    if(mm != slot){
+        proc_lent[mm]--;
+        proc_mm[slot] = slot;
+        mm_unlock(slot);
+    }
+    mm_unlock(mm);
+    return 0;
+}
+
+// Create a process from a new image like create_ps, as the child of the process with given pid that
+// shares the pages of regions[0..num_regions) with it: both map the same frames with the parent's
+// protections and see each other's writes. Reserved and copy on write pages of the parent are made
+// resident and private to it first so that there is a frame to share. Only the new image and the shared
+// regions are touched, never the rest of the parent.
+// Returns the pid of the child, or -1 if the parent does not exist, the image does not fit, a region page
+// is not mapped in the parent or overlaps the child's image (nothing is created in that case).
+int spawn_ps(int pid, int code_size, int ro_data_size, int rw_data_size, int max_stack_size,
+             unsigned char* code_and_ro_data, const struct mem_region* regions, int num_regions)
+{
+    int parent = pid_to_mm(pid);
+    if(parent == -1){
+        printf("Error : no such process \n");
+        return -1;
     }
-    struct PCB* curr = (struct PCB*) ( &OS_MEM[start_index_page_tables+ 4108*pcb_index_to_allocate]);
-    curr->is_free = 0;
-    int process_id_allocated = curr->pid;
-    for(int i=0; i<1024; i++){
-        page_table_entry pte = to_cpy->page_table[i];
-        if(is_present(pte)){
-            int page_to_allocate = i;
-            if(page_to_allocate==-1){
-                printf("Error : no page available to allocate in  virt mem");
+    int child_pid = create_ps(code_size, ro_data_size, rw_data_size, max_stack_size, code_and_ro_data);
+    if(child_pid == -1){
+        return -1;
+    }
+    int slot = pid_to_slot(child_pid);
+    mm_lock(parent);
+    mm_lock(slot);
+    for(int r=0; r<num_regions; r++){
+        int first_page = regions[r].vmem_addr / PAGE_SIZE;
+        int num_pages = regions[r].num_pages;
+        if(first_page < 0 || num_pages < 0 || first_page + num_pages > NUM_PAGES ||
+           map_page_tables(slot, first_page, num_pages) == -1){
+            printf("Error : bad shared region \n");
+            exit_ps(child_pid);
+            mm_unlock(slot);
+            mm_unlock(parent);
+            return -1;
+        }
+        for(int page=first_page; page<first_page + num_pages; page++){
+            page_table_entry pte = pte_get(parent, page);
+            int flags = get_flags(pte) | ((pte & PTE_COW) ? O_WRITE : 0);
+            if((pte & PTE_RESERVED) || (pte & PTE_COW)){
+                // a read fault maps the zero page, which is only shared as long as the page is read only
+                if(page_fault(parent, page, (flags & O_WRITE) ? O_WRITE : O_READ) == -1){
+                    exit_ps(child_pid);
+                    mm_unlock(slot);
+                    mm_unlock(parent);
+                    return -1;
+                }
+                pte = pte_get(parent, page);
             }
-            int page_frame_to_allocate = get_free_page_frame_index();
-            // printf("free page frame is %d\n", page_frame_to_allocate);
-            RAM[(page_frame_to_allocate-18432)]=allocated;
-            // printf("FORK CASE : Setting value as %d\n", build_pte(page_to_allocate, page_frame_to_allocate, 1, get_flags(curr->page_table[page_to_allocate])));
-            curr->page_table[page_to_allocate] = build_pte(page_to_allocate, page_frame_to_allocate, 1, get_flags(to_cpy->page_table[i]));
-            // printf("Set value is %d\n", build_pte(page_to_allocate, page_frame_to_allocate, 1, get_flags(to_cpy->page_table[i])));
-            // RAM[(page_frame_to_allocate)*4*1024] to RAM[((page_frame_to_allocate)+1)*4*1024 - 1] to be filled now
-            memcpy(OS_MEM + (page_frame_to_allocate)*4*1024, OS_MEM + (pte_to_frame_num(to_cpy->page_table[i]))*4*1024, 4*1024);
-            curr->page_table_count++;
+            if(!is_present(pte) || is_mapped(pte_get(slot, page))){
+                printf("Error : bad shared region \n");
+                exit_ps(child_pid);
+                mm_unlock(slot);
+                mm_unlock(parent);
+                return -1;
+            }
+            frame_get(pte_to_frame_num(pte));
+            pte_install(slot, page, (pte & ~(PTE_ACCESSED | PTE_DIRTY)) | PTE_SHARED);
+            proc_rss[slot]++;
         }
     }
-    // DONE student:
-    return process_id_allocated;
+    // only marked shared in the parent once the spawn can no longer fail
+    for(int r=0; r<num_regions; r++){
+        int first_page = regions[r].vmem_addr / PAGE_SIZE;
+        for(int page=first_page; page<first_page + regions[r].num_pages; page++){
+            pte_update(parent, page, pte_get(parent, page) | PTE_SHARED);
+        }
+    }
+    mm_unlock(slot);
+    mm_unlock(parent);
+    return child_pid;
 }
 
 
-
 // dynamic heap allocation
 //
 // Allocate num_pages amount of pages for process pid, starting at vmem_addr.
@@ -339,27 +2833,60 @@ int fork_ps(int pid) {
 //
 // If any of the pages was already allocated then kill the process, deallocate all its resources(exit_ps) 
 // and set error_no to ERR_SEG_FAULT.
+// If there is no room for the pages nothing is allocated, the process lives on and error_no is set to ERR_NO_MEM.
+//
+// With use_lazy_heap the pages are only reserved, reads see the zero page and the first write to a page
+// allocates its frame, so a large sparse heap costs page table entries only.
 void allocate_pages(int pid, int vmem_addr, int num_pages, int flags) 
 {
    // DONE student
-   unsigned char allocated = 1;
-    struct PCB* curr = (struct PCB*) ( &OS_MEM[start_index_page_tables + 4108*pid]);
-    if(curr->is_free){
+    struct PCB* curr = pid_to_pcb(pid);
+    if(curr == NULL){
         error_no = ERR_SEG_FAULT;
+        return;
     }
+    int mm = pid_to_mm(pid);
+    mm_lock(mm);
     for(int i = (vmem_addr)/(PAGE_SIZE); i < (vmem_addr)/(PAGE_SIZE) +num_pages; i++){
-        if(is_present(curr->page_table[i])==1){
+        if(i >= NUM_PAGES || is_mapped(pte_get(pid_to_mm(pid), i))==1){
             error_no = ERR_SEG_FAULT;
             exit_ps(pid);
+            mm_unlock(mm);
             return;
-        }else{
-            //TODO complete allocation with page no, frame no
-            int frame_number_to_allocate = get_free_page_frame_index();
-            RAM[frame_number_to_allocate - 18432] = allocated;
-            curr->page_table[i] = build_pte(i, frame_number_to_allocate, 1, flags);
         }
     }
-    curr->page_table_count+=num_pages;
+    // reject in O(1) if PS_MEM cannot hold the pages, the process is left as it was
+    int frames_needed = use_lazy_heap ? 0 : num_pages;
+    if(reserve_frames(frames_needed) == -1){
+        printf("Error : no free space \n");
+        error_no = ERR_NO_MEM;
+        mm_unlock(mm);
+        return;
+    }
+    if(map_page_tables(pid_to_mm(pid), vmem_addr/PAGE_SIZE, num_pages) == -1){
+        unreserve_frames(frames_needed);
+        printf("Error : no free space \n");
+        error_no = ERR_NO_MEM;
+        mm_unlock(mm);
+        return;
+    }
+    if(use_lazy_heap){
+        map_pages_reserved(pid_to_mm(pid), vmem_addr/PAGE_SIZE, num_pages, flags);
+        mm_unlock(mm);
+        return;
+    }
+    struct frame_extent extents[NUM_PAGES];
+    if(alloc_frames(num_pages, extents) == -1){
+        unmap_page_tables(pid_to_mm(pid), vmem_addr/PAGE_SIZE, num_pages);
+        printf("Error : no free space \n");
+        error_no = ERR_NO_MEM;
+        mm_unlock(mm);
+        return;
+    }
+    int ext_index = 0;
+    int ext_offset = 0;
+    map_pages_from_extents(pid_to_mm(pid), (vmem_addr)/(PAGE_SIZE), num_pages, flags, extents, &ext_index, &ext_offset, NULL);
+    mm_unlock(mm);
 }
 
 
@@ -375,23 +2902,36 @@ void allocate_pages(int pid, int vmem_addr, int num_pages, int flags)
 void deallocate_pages(int pid, int vmem_addr, int num_pages) 
 {
    // DONE student
-   unsigned char empty = 0;
-    struct PCB* curr = (struct PCB*) ( &OS_MEM[start_index_page_tables + 4108*pid]);
-    if(curr->is_free){
+    struct PCB* curr = pid_to_pcb(pid);
+    if(curr == NULL){
         error_no = ERR_SEG_FAULT;
+        return;
     }
+    int mm = pid_to_mm(pid);
+    mm_lock(mm);
     for(int i = (vmem_addr)/(PAGE_SIZE); i < (vmem_addr)/(PAGE_SIZE) +  num_pages; i++){
-        if(is_present(curr->page_table[i])==0){
+        page_table_entry pte = i >= NUM_PAGES ? 0 : pte_get(pid_to_mm(pid), i);
+        if(is_mapped(pte)==0){
             error_no = ERR_SEG_FAULT;
             exit_ps(pid);
+            mm_unlock(mm);
             return;
-        }else{
-            int frame_number_to_drop = pte_to_frame_num(curr->page_table[i]);
-            RAM[frame_number_to_drop - 18432] = empty;
-            curr->page_table[i] = build_pte(0, 0, 0, 0);
+        }
+        // the pte is cleared first so that pin_mem sees the page go before the frame can be reused
+        // a reserved page that was never touched has no frame
+        pte_clear(pid_to_mm(pid), i);
+        if(is_present(pte)){
+            frame_put(pte_to_frame_num(pte));
+            proc_rss[pid_to_mm(pid)]--;
         }
     }
-    curr->page_table_count-=num_pages;
+    // emptied second level tables stay with the process until exit_ps, so a heap that is freed and
+    // allocated again does not go through pcb_table_lock each time. Hashed entries are one per page
+    // and shared by all processes, they go back right away
+    if(page_table_backend == PT_HASHED){
+        unmap_page_tables(pid_to_mm(pid), vmem_addr/PAGE_SIZE, num_pages);
+    }
+    mm_unlock(mm);
 }
 
 // Read the byte at `vmem_addr` virtual address of the process
@@ -402,23 +2942,27 @@ void deallocate_pages(int pid, int vmem_addr, int num_pages)
 unsigned char read_mem(int pid, int vmem_addr) 
 {
     // DONE: student
-    struct PCB* curr = (struct PCB*) ( &OS_MEM[start_index_page_tables + 4108*pid]);
-    if(curr->is_free){
+    struct PCB* curr = pid_to_pcb(pid);
+    if(curr == NULL){
         error_no = ERR_SEG_FAULT;
+        return -1;
     }
     int page_number = vmem_addr%PAGE_SIZE == 0 ? (int)(vmem_addr/PAGE_SIZE): (int)(vmem_addr/PAGE_SIZE);
     // printf("%d \n", page_number);
     int byte_offset = (vmem_addr%PAGE_SIZE);
     // printf("%d\n", byte_offset);
-    if(is_readable(curr->page_table[page_number])==0){
+    int mm = pid_to_mm(pid);
+    mm_access_begin(mm);
+    unsigned char* frame = tlb_translate(mm, page_number, O_READ);
+    if(frame == NULL){
+        mm_access_end(mm);
         error_no = ERR_SEG_FAULT;
         exit_ps(pid);
         // printf("Error\n");
         return -1;
     }else{
-        int frame_number = pte_to_frame_num(curr->page_table[page_number]);
-        // printf("%d\n", frame_number);
-        unsigned char res = (unsigned char) RAM[frame_number*4*1024 + byte_offset];
+        unsigned char res = frame[byte_offset];
+        mm_access_end(mm);
         // printf("%c \n", res);
         return res;
     }
@@ -434,104 +2978,345 @@ unsigned char read_mem(int pid, int vmem_addr)
 void write_mem(int pid, int vmem_addr, unsigned char byte) 
 {
     // DONE: student
-    struct PCB* curr = (struct PCB*) ( &OS_MEM[start_index_page_tables + 4108*pid]);
-    if(curr->is_free){
+    struct PCB* curr = pid_to_pcb(pid);
+    if(curr == NULL){
         error_no = ERR_SEG_FAULT;
+        return;
     }
     int page_number = (int)(vmem_addr/PAGE_SIZE);
     // printf("page number %d \n", page_number);
     int byte_offset = (vmem_addr % PAGE_SIZE);
     // printf("byte_offset %d \n", byte_offset);
-    if(is_writeable(curr->page_table[page_number])==0 || !is_present(curr->page_table[page_number])){
+    int mm = pid_to_mm(pid);
+    mm_access_begin(mm);
+    unsigned char* frame = tlb_translate(mm, page_number, O_WRITE);
+    if(frame == NULL){
+        mm_access_end(mm);
         // printf("SEG_FAULT\n");
         error_no = ERR_SEG_FAULT;
         exit_ps(pid);
     }else{
-        int frame_number = pte_to_frame_num(curr->page_table[page_number]);
-        // printf("frame number %d \n", frame_number);
-        RAM[frame_number*4*1024 + byte_offset] = byte;
+        frame[byte_offset] = byte;
+        mm_access_end(mm);
     }
 }
 
 
+// copy len bytes between buf and the process's memory starting at vmem_addr, one memcpy per page
+// with the permission check done once per page. Behaves like len read_mem/write_mem calls: on an
+// illegal access the bytes before the faulting page have been copied, the process is killed and
+// error_no is set to ERR_SEG_FAULT. Returns the number of bytes copied.
+int copy_mem_range(int pid, int vmem_addr, unsigned char* buf, int len, int access)
+{
+    if(pid_to_pcb(pid) == NULL){
+        error_no = ERR_SEG_FAULT;
+        return 0;
+    }
+    int mm = pid_to_mm(pid);
+    int done = 0;
+    mm_access_begin(mm);
+    while(done < len){
+        int addr = vmem_addr + done;
+        int byte_offset = addr % PAGE_SIZE;
+        int span = PAGE_SIZE - byte_offset < len - done ? PAGE_SIZE - byte_offset : len - done;
+        unsigned char* frame = addr < 0 || addr >= PS_VIRTUAL_MEM_SIZE ? NULL
+                               : tlb_translate(mm, addr / PAGE_SIZE, access);
+        if(frame == NULL){
+            mm_access_end(mm);
+            error_no = ERR_SEG_FAULT;
+            exit_ps(pid);
+            return done;
+        }
+        if(access == O_WRITE){
+            memcpy(frame + byte_offset, buf + done, span);
+        }else{
+            memcpy(buf + done, frame + byte_offset, span);
+        }
+        done += span;
+    }
+    mm_access_end(mm);
+    return done;
+}
+
+// Read len bytes at `vmem_addr` virtual address of the process into buf
+int read_mem_range(int pid, int vmem_addr, unsigned char* buf, int len)
+{
+    return copy_mem_range(pid, vmem_addr, buf, len, O_READ);
+}
 
-// ---------------------- Helper functions for Page table entries ------------------ // 
+// Write len bytes from buf at `vmem_addr` virtual address of the process
+int write_mem_range(int pid, int vmem_addr, const unsigned char* buf, int len)
+{
+    return copy_mem_range(pid, vmem_addr, (unsigned char*) buf, len, O_WRITE);
+}
 
-// return the page number from the pte
-int pte_to_page_num(page_table_entry pte) 
+// Pin len bytes of the process's memory starting at vmem_addr for direct access with the given
+// access (O_READ or O_WRITE) and describe them in spans, one per run of pages that is contiguous in RAM.
+// Pinned frames hold a reference each, so they stay valid after deallocate_pages or exit_ps of the
+// process until unpin_mem. Pinning for O_WRITE marks the pages dirty.
+// Returns the number of spans. An illegal access kills the process like write_mem/read_mem, sets error_no
+// to ERR_SEG_FAULT and returns -1; more than max_spans spans also return -1 but leave the process alone.
+// Nothing stays pinned when -1 is returned.
+int pin_mem(int pid, int vmem_addr, int len, int access, struct mem_span* spans, int max_spans)
 {
-    // DONE: student
-    // printf("Getting page from page table entry %u \n", pte);
-    // unsigned int res = (pte & (1023<<22))>>22;
-    // printf("Res is %u\n",res);
-    return (unsigned int) (pte & (1023<<22))>>22 ;
+    int slot = pid_to_live_slot(pid);
+    if(slot == -1){
+        error_no = ERR_SEG_FAULT;
+        return -1;
+    }
+    // pages are looked up in the address space the process uses, liveness is checked on its own slot
+    int mm = proc_mm[slot];
+    // ksm_scan must not move a page to another frame between the pin and the check below
+    mm_lock(mm);
+    mm_access_begin(mm);
+    int count = 0;
+    int done = 0;
+    while(done < len){
+        int addr = vmem_addr + done;
+        int byte_offset = addr % PAGE_SIZE;
+        int span = PAGE_SIZE - byte_offset < len - done ? PAGE_SIZE - byte_offset : len - done;
+        int page = addr / PAGE_SIZE;
+        unsigned char* frame = addr < 0 || addr >= PS_VIRTUAL_MEM_SIZE ? NULL : tlb_translate(mm, page, access);
+        int frame_num = frame == NULL ? -1 : (int)((frame - RAM) / PAGE_SIZE);
+        // the reference is taken speculatively, the pte and the process are checked again afterwards
+        // in case a concurrent deallocate_pages/exit_ps dropped the frame in between
+        int pinned = frame_num != -1 && frame_get_unless_free(frame_num);
+        int gone = __atomic_load_n(&proc_is_free[slot], __ATOMIC_SEQ_CST) || proc_pid[slot] != pid;
+        if(pinned && (gone || pte_to_frame_num(pte_get(mm, page)) != frame_num || !is_present(pte_get(mm, page)))){
+            frame_put(frame_num);
+            pinned = 0;
+        }
+        int merge = pinned && count > 0 && spans[count-1].ptr + spans[count-1].len == frame + byte_offset;
+        if(!pinned || (!merge && count == max_spans)){
+            if(pinned){
+                frame_put(frame_num);
+            }
+            unpin_mem(spans, count);
+            mm_access_end(mm);
+            if(!pinned){
+                error_no = ERR_SEG_FAULT;
+                // a process that is exiting concurrently is left to that exit_ps
+                if(!gone){
+                    exit_ps(pid);
+                }
+            }
+            mm_unlock(mm);
+            return -1;
+        }
+        if(frame_num != zero_frame){
+            __atomic_add_fetch(&frame_pin_count(frame_num), 1, __ATOMIC_SEQ_CST);
+        }
+        if(merge){
+            spans[count-1].len += span;
+        }else{
+            spans[count].ptr = frame + byte_offset;
+            spans[count++].len = span;
+        }
+        done += span;
+    }
+    mm_access_end(mm);
+    mm_unlock(mm);
+    return count;
 }
 
-// return the frame number from the pte
-int pte_to_frame_num(page_table_entry pte) 
+// drop the pins taken by pin_mem, frames of pages that were deallocated in the meantime are freed now
+void unpin_mem(struct mem_span* spans, int num_spans)
 {
-    // DONE: student
-    // printf("Getting frame_num from page table entry %u \n", pte);
-    // unsigned int res = (pte & (65535<<6))>>6;
-    return (pte & (65535<<6))>>6;
+    for(int i=0; i<num_spans; i++){
+        int first = (spans[i].ptr - RAM) / PAGE_SIZE;
+        int last = (spans[i].ptr + spans[i].len - 1 - RAM) / PAGE_SIZE;
+        for(int frame=first; frame<=last; frame++){
+            if(frame != zero_frame){
+                __atomic_sub_fetch(&frame_pin_count(frame), 1, __ATOMIC_SEQ_CST);
+            }
+            frame_put(frame);
+        }
+    }
 }
 
 
-// return 1 if read bit is set in the pte
-// 0 otherwise
-int is_readable(page_table_entry pte) {
-    // DONE: student
-    // printf("Getting is_readable bit from page table entry %u \n", pte);
-    // unsigned int res = pte & O_READ;
-    // printf("Res is %u\n",res);
-    return (pte & O_READ) == 1;
+// translation of one address for translate_batch
+void translate_one(int slot, int vmem_addr, long* phys, int* status){
+    page_table_entry pte = vmem_addr < 0 || vmem_addr >= PS_VIRTUAL_MEM_SIZE ? 0 : pte_get(slot, vmem_addr / PAGE_SIZE);
+    *status = is_present(pte) ? get_flags(pte) : 0;
+    *phys = *status ? (long)pte_to_frame_num(pte) * PAGE_SIZE + vmem_addr % PAGE_SIZE : 0;
 }
 
-// return 1 if write bit is set in the pte
-// 0 otherwise
-int is_writeable(page_table_entry pte) {
-    // DONE: student
-    // printf("Getting is_writable bit from page table entry %u \n", pte);
-    // unsigned int res = (pte & O_WRITE)>>1;
-    // printf("Res is %u\n",res);
-    return ((pte & O_WRITE)>>1) ==1;
+#ifdef __AVX2__
+// translate_one for 8 addresses of a process with two level page tables: the directory entries and the
+// ptes are fetched with gathers, the present bit, protection bits and frame number are decoded with masks
+void translate_batch8(int slot, const int* vaddrs, long* out_phys, int* out_status){
+    __m256i addr = _mm256_loadu_si256((const __m256i*) vaddrs);
+    __m256i in_range = _mm256_andnot_si256(_mm256_cmpgt_epi32(_mm256_setzero_si256(), addr),
+                                          _mm256_cmpgt_epi32(_mm256_set1_epi32(PS_VIRTUAL_MEM_SIZE), addr));
+    __m256i page = _mm256_srli_epi32(_mm256_and_si256(addr, in_range), PAGE_SHIFT);
+    __m256i leaf = _mm256_mask_i32gather_epi32(_mm256_set1_epi32(PT_NO_LEAF), pcb_at(slot)->page_dir,
+                                               _mm256_srli_epi32(page, PT_LEAF_SHIFT), in_range, 4);
+    __m256i has_leaf = _mm256_cmpgt_epi32(leaf, _mm256_set1_epi32(PT_NO_LEAF));
+    __m256i idx = _mm256_add_epi32(_mm256_slli_epi32(leaf, PT_LEAF_SHIFT),
+                                   _mm256_and_si256(page, _mm256_set1_epi32(PT_LEAF_ENTRIES - 1)));
+    __m256i offset = _mm256_and_si256(addr, _mm256_set1_epi32(PAGE_SIZE - 1));
+    // picks the low halves of 4 64 bit lanes into the low 128 bits
+    __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    for(int half=0; half<2; half++){
+        __m128i idx4 = half ? _mm256_extracti128_si256(idx, 1) : _mm256_castsi256_si128(idx);
+        __m128i has_leaf4 = half ? _mm256_extracti128_si256(has_leaf, 1) : _mm256_castsi256_si128(has_leaf);
+        __m128i offset4 = half ? _mm256_extracti128_si256(offset, 1) : _mm256_castsi256_si128(offset);
+        // lanes without a second level table read as an empty pte
+        __m256i pte = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(), (const long long*) page_table_pool,
+                                                  idx4, _mm256_cvtepi32_epi64(has_leaf4), 8);
+        __m256i present = _mm256_cmpeq_epi64(_mm256_and_si256(pte, _mm256_set1_epi64x(PTE_PRESENT)),
+                                             _mm256_set1_epi64x(PTE_PRESENT));
+        __m256i flags = _mm256_and_si256(_mm256_and_si256(pte, _mm256_set1_epi64x(7)), present);
+        __m256i mapped = _mm256_cmpgt_epi64(flags, _mm256_setzero_si256());
+        __m256i frame = _mm256_srli_epi64(_mm256_and_si256(pte, _mm256_set1_epi64x(PTE_FRAME_MASK)), PTE_FRAME_SHIFT);
+        __m256i phys = _mm256_or_si256(_mm256_slli_epi64(frame, PAGE_SHIFT), _mm256_cvtepi32_epi64(offset4));
+        _mm256_storeu_si256((__m256i*) (out_phys + 4 * half), _mm256_and_si256(phys, mapped));
+        _mm_storeu_si128((__m128i*) (out_status + 4 * half),
+                         _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(flags, low_halves)));
+    }
 }
+#endif
 
-// return 1 if executable bit is set in the pte
-// 0 otherwise
-int is_executable(page_table_entry pte) {
-    // DONE: student
-    // printf("Getting is_executable bit from page table entry %u \n", pte);
-    // unsigned int res = (pte & O_EX)>>2;
-    // printf("Res is %u\n",res);
-    return ((pte & O_EX)>>2) == 1;
+// Translate n virtual addresses of the process at once: out_phys[i] gets the physical address (offset
+// into RAM) of vaddrs[i] and out_status[i] the protection bits of its page, 0 if it is not mapped.
+// Only the page table is consulted, the TLB is not filled and the accessed/dirty bits are left alone.
+// Copy on write pages read as not writable until they are written through write_mem or write_mem_batch,
+// reserved pages read as not mapped until their first access.
+// With AVX2 and two level page tables 8 addresses are translated per step, otherwise one at a time.
+// Returns 0, or -1 with error_no set to ERR_SEG_FAULT if there is no such process.
+int translate_batch(int pid, const int* vaddrs, int n, long* out_phys, int* out_status)
+{
+    int slot = pid_to_mm(pid);
+    if(slot == -1){
+        error_no = ERR_SEG_FAULT;
+        return -1;
+    }
+    // the page table is read like a memory access reads it, ksm_scan does not move a page under the walk
+    mm_access_begin(slot);
+    translate_range(slot, vaddrs, n, out_phys, out_status);
+    mm_access_end(slot);
+    return 0;
 }
 
-int get_flags(page_table_entry pte){
-    // unsigned int res = (pte & 7);
-    // printf("Res is %u\n",res);
-    return (pte & 7);
+// translate_batch for the address space in slot, the caller has begun the access (mm_access_begin)
+void translate_range(int slot, const int* vaddrs, int n, long* out_phys, int* out_status)
+{
+    int i = 0;
+#ifdef __AVX2__
+    // the gathers index the page table pool with 32 bit lanes
+    if(use_simd && page_table_backend == PT_TWO_LEVEL && OS_MEM_SIZE / sizeof(page_table_entry) <= INT32_MAX){
+        for(; i + 8 <= n; i += 8){
+            translate_batch8(slot, vaddrs + i, out_phys + i, out_status + i);
+        }
+    }
+#endif
+    for(; i<n; i++){
+        translate_one(slot, vaddrs[i], &out_phys[i], &out_status[i]);
+    }
 }
 
-// return 1 if present bit is set in the pte
-// 0 otherwise
-int is_present(page_table_entry pte) {
-    // DONE: student
-    // printf("Getting present bit from page table entry %u \n", pte);
-    // unsigned int res = (pte & (1<<3))>>3;
-    // printf("Res is %u\n",res);
-    return ((pte & (1<<3))>>3) == 1;
+// read or write the bytes at n independent virtual addresses, translated MEM_BATCH at a time
+int access_mem_batch(int pid, const int* vaddrs, int n, unsigned char* bytes, int access)
+{
+    long phys[MEM_BATCH];
+    int status[MEM_BATCH];
+    int mm = pid_to_mm(pid);
+    if(mm == -1){
+        error_no = ERR_SEG_FAULT;
+        return 0;
+    }
+    int done = 0;
+    while(done < n){
+        int count = n - done < MEM_BATCH ? n - done : MEM_BATCH;
+        // the translations are only good until the access ends
+        mm_access_begin(mm);
+        translate_range(mm, vaddrs + done, count, phys, status);
+        int i = 0;
+        int last_page = -1;
+        for(; i<count; i++){
+            if(!(status[i] & access)){
+                mm_access_end(mm);
+                // a reserved page gets its frame and a write to a copy on write page copies it,
+                // the rest of the batch is translated again
+                int addr = vaddrs[done + i];
+                if(addr >= 0 && addr < PS_VIRTUAL_MEM_SIZE && page_fault(mm, addr / PAGE_SIZE, access) == 0){
+                    break;
+                }
+                error_no = ERR_SEG_FAULT;
+                exit_ps(pid);
+                return done + i;
+            }
+            // the accessed and dirty bits are set as a TLB miss of read_mem/write_mem sets them, once for a
+            // run of addresses in the same page
+            int page = vaddrs[done + i] / PAGE_SIZE;
+            if(page != last_page){
+                pte_mark(mm, page, access);
+                last_page = page;
+            }
+            if(access == O_WRITE){
+                RAM[phys[i]] = bytes[done + i];
+            }else{
+                bytes[done + i] = RAM[phys[i]];
+            }
+        }
+        if(i == count){
+            mm_access_end(mm);
+        }
+        done += i;
+    }
+    return n;
+}
+
+// Read the bytes at vaddrs[0..n) of the process into out. Behaves like n read_mem calls: on the first
+// illegal address the process is killed and error_no is set to ERR_SEG_FAULT.
+// Returns the number of bytes read.
+int read_mem_batch(int pid, const int* vaddrs, int n, unsigned char* out)
+{
+    return access_mem_batch(pid, vaddrs, n, out, O_READ);
+}
+
+// Write bytes[i] at vaddrs[i] of the process for i in [0, n), in order, like n write_mem calls.
+// Returns the number of bytes written.
+int write_mem_batch(int pid, const int* vaddrs, const unsigned char* bytes, int n)
+{
+    return access_mem_batch(pid, vaddrs, n, (unsigned char*) bytes, O_WRITE);
 }
 
+// ---------------------- Helper functions for Page table entries ------------------ // 
+
+// pte_to_frame_num, is_readable, is_writeable, is_executable, get_flags and is_present are inline in mmu.h
+
 
 // -------------------  functions to print the state  --------------------------------------------- //
 
 void print_page_table(int pid) 
 {
-    struct PCB* temp = (struct PCB*) ( &OS_MEM[start_index_page_tables + 4108*pid]);
-    page_table_entry* page_table_start = temp->page_table; // DONE student: start of page table of process pid
-    int num_page_table_entries = 1024;           // DONE student: num of page table entries
+    struct PCB* temp = pid_to_pcb(pid);
+    if(temp == NULL){
+        printf("Error : no such process %d \n", pid);
+        return;
+    }
+    // gather the two level table into a flat view, unmapped ranges read as empty entries
+    page_table_entry page_table_start[NUM_PAGES];    // DONE student: start of page table of process pid
+    int num_page_table_entries = NUM_PAGES;          // DONE student: num of page table entries
+    // reserved pages are shown with their protection bits and P0 until their first access gives them a frame
+    int resident_pages = 0;
+    int reserved_pages = 0;
+    int zero_pages = 0;
+    int cow_pages = 0;
+    for(int i=0; i<num_page_table_entries; i++){
+        page_table_entry pte = pte_get(pid_to_mm(pid), i);
+        // copy on write pages are shown read only as they are mapped, the summary counts them
+        page_table_start[i] = pte;
+        resident_pages += is_present(pte);
+        reserved_pages += (pte & PTE_RESERVED) != 0;
+        zero_pages += is_present(pte) && pte_to_frame_num(pte) == zero_frame;
+        cow_pages += (pte & PTE_COW) != 0;
+    }
     printf("No of page table entries %d \n", num_page_table_entries);
+    printf("Resident pages %d (%d on the zero page, %d copy on write), reserved pages %d \n",
+           resident_pages, zero_pages, cow_pages, reserved_pages);
     // Do not change anything below
     puts("------ Printing page table-------");
     for (int i = 0; i < num_page_table_entries; i++) 
@@ -549,59 +3334,790 @@ void print_page_table(int pid)
 
 }
 
-// int main(){
-//     int page_num = 234;
-//     int frame_num = 11223;
-//     int flags = 6;
-//     int read = 0;
-//     int write = 1;
-//     int exec = 1;
-//     int present = 0;
-//     page_table_entry pte = build_pte(page_num, frame_num, present, 6);
-//     printf("%u should be %d\n",is_readable(pte), read);
-//     printf("%u should be %d\n",is_executable(pte), exec);
-//     printf("%u should be %d\n",is_writeable(pte), write);
-//     printf("%u should be %d\n",is_present(pte), present);
-//     printf("%u should be %d\n",pte_to_page_num(pte), page_num);
-//     printf("%u should be %d\n",pte_to_frame_num(pte), frame_num);
-//     printf("%d",NUM_USABLE_FRAMES);
-//     os_init();
-//     // for(int i=start_index_free_list; i<=end_index_free_list; i++){
-//     //     printf("%d\n",(int)RAM[i]);
-//     // }
-//     struct PCB x;
-//     // printf("%lu",sizeof(char));
-//     printf("%lu\n",sizeof(x));
-//     printf("%d, %d\n",start_index_page_tables,end_index_page_tables);
-//     // struct PCB* sap = (struct PCB*) ( &OS_MEM[start_index_page_tables]);
-//     // int pid = sap->pid;
-//     // int ptc = sap->page_table_count;
-//     // printf("%d, %d \n", pid, ptc);
-//     // for(int i=0; i<99; i++){
-//     //     sap++;
-//     //     pid = sap->pid;
-//     //     ptc = sap->page_table_count;
-//     //     printf("%d, %d, %d \n", i+2, pid, ptc);
-//     // }
-//     unsigned char* p = (unsigned char*) "59VltqGAApwoHMNOJLF4hP7PXEsi0qlJd2RC0jR7n51oI9f5lUzYCPSUjJB2L8j2Rq2Zb9FcyrHNhc64XB9V7adE2coMUtdMQVrWXAYP5KfYkv6k5g7SbUu3gbZBeCDXY2w1M23hDuw06xRziU4Z4B7ALyZhnNeErLIo5uZsjpEP3eh5oLFElR7M4XVDRJGGE6VWN4RO3SHDsUsYByOP47XxcdMXe6zbVuQofRSct1cSy91WtPljuxb7ZiWphIYyCAdP0k4ivWnT5XZ5sywtPVhUiWWae98yAsvfeQe4wa3jHF7XvLVGd1EKwKv9OxZq1t3sDVnwarduqbLyM3CFy4VxHMqfrL8O9iH5ed7ghJtn9pUHzlct2ekYBUmA9iUR5SRCJRhtmloYw862fhyoGoYGwYe3WZ8gkLEGzVX7SV7ZdYcB6AF1kUgpAYBCpToQXWPRQJXnD7acn07MEbpyVw4H7uDthMakWlZRHB30B9w5d37zYreCGUuKUjDuPzRy4EdZSl5hyZO2krviW9OqvjyygKRDE75S6K8x2qAWNQLH6TLy3uYQzTrsCJl5ZmWqonePV8QuvOFeCA16tjzTgjUGYFLDHGHBLoFyWdVDLgF9COF8joo5m4PjPUorRzQ5TPd3bcNhpvASH630Z6z8Va9Chvn0iSsduzw2VQ04GrX26AAvH5K9NxO8aXi0xdu9fjeCPiJtDJ3fJvlNazFQpUv23o6KZhxWSYATZCB7ASu9dVb6euYHLqnOr3lSOQLvT8l1ikFxE4nuB00QxzEmqrHq2lB7lhKtGU6tzctxewgLM20XUYOZLVqse8JVyqgZp0tU4wP1Cg6tRveX6HDhpmEUBU5zMA0YIhKz1nLMkrEY7nOrWnbOu1eN9rvbtT6e3Hy2eaxzr5Z4CQbf2yWxcB3itkSOz9QGX1hrKhVPTN7h8idtSxIHsqqpNbaei62gUK9j4MK5rCvGgIS9CunO2u6I8KUckjHtexw784auGWOVpdsUW8nEO1HuoUueAgUS3VePJpBcXYYlUwigm7TchYnP03e7Q8QOuK0IRxecVXdQeXWsQwG8FLjkTUWIpEGJFam9ZfT6vxuk2Cg1SwxYEJLlrSsQP66ycEBNtyFWfy7TROnIhmjNeaDqYiD6aA8SpcWwDtY8xky5zbMgqJyo4O6krbz1IxAsGyQ4kzgYQJVgOSh4bLF5TWUAVX4KgnndYS28fmndSSwUn1BnQnqW6zDW5dkK9EPuA7GvzNGYuuqfUuhOQW3Xh2XgnCz2Ro9Fw2xnJtMWRByC2QxVjpubvgTUf0KGyHDq5fkSQzKGqbGxOF8npEqloWroroKxepnq1BVJqbyuL27n7IeP7Hp5NCmARKb9GPIWvZM0NeKBCdsbUH6YMKZgxbgmdXxJw9xN6SSEmA4OQKSqUSM9SnjE3UkV0n007Gr59jthmrCTgCffgMvNi8PRJuUfLVHUpDJbt4ZoW8tlkqsAFO9cKzeDsDLonSZUqZR1J31SWdVaDOgErAPOpB9WH5lFkK192dF7x2UuRWwFc7w8mbmyaVd7qqGFIgq8MiPom0gTJAVKLSgfRU2ilgof6dLtTbvGkIpiwgxdmCk9F0FCKItD9WpuyacLYPgli5Y7syyNhPMJKO6krFUqOGc34EwpDe1eHVyXFE9y1VWYQXrwNjNwMCqKvtMS5aMlPgbQxuIicNc3dIndpbudPOOCDcrPho3JZUN4wcepeY9DNY0qAPzZrIpcoAZTMNKkgyHluCH1kBZfg7xZwc3lJ6cOD68Qxi9hIcUzZ8IsTniKFVQ6Ogr8gXcO05ABiPD3TtWpo3Isgl3w0MhnO21GzkPOUXe1mTG4fgaawNPi1TgZtWpnHJQBJkq1FS69AN4pjqRvkacXR5AnOGvGVzMR7VSYGKbuFAv3bE6UJrn7ENU0Lt8Jkcoebtdjxe4IdWvnwmMOopsGAdYfiqesWqoscKUcfLlq4ajSHvGPUM17knZy4umoLDS6H2Nfy1SprdggeaqasOfRaMtSrPG2UPaTkVa0vrUI8LVxblXB0sxS2XBjAhVSPiZEIrFOZeiWk9mD3gOjfTllkJ8Vy7gwqtiJPAjhhMG1PbXe74nX6gUcrzfPmNMFbIy6779Ncd2RJB2hzdZwCQCgTNG6PzoLulYkIeyVbaOiIFv6LKuzFfncWzDvLS6S2IiONKRb7gIpRIXRxtPfWoF4twep2KDpLGhr60NdkJ7Gb7c9NwvgLozjTsU0sBbE7SJ0ntR0WTSFKDrePH8ovKDHgGkCaZFmNmnyl3wZhfRGIWhUsz7hQDMSgng0lDqOcCVgOvINs2GO79LGaIrY0dt5tVrpf4qJYOTTe9rSj4zVgZYKgiWWuAf8GBdC22iZOriySKCmM70fbnMBkOp7c6QWDWM68l1aEzgOLUAthCdS7mLS7ij2Nxer9ZRxWy2RvmIEldaw9scL18bKFE8tXXMmsI2ktILoSQ1vhgvgWA80Fy2afpQCEGHGA09ay0JXM2rnAjlwzQ8OggT6E38sRnkMqwKEIeToftL9yJ1IU05MuPG5Lq7Wk4HUeA5Hoau13FhNVhZ8Ynfe8BFqSRdZbuwPqs5riva24xkGyrJ5hGCacCwLF6pvjdyPKmtteKAvqeVVPHTRAKXvLRDmt8I0bK8y2bwqHJUTkljgob8DpvItPeAIYbErxZrvG4exTh6zGom5N35dHZNOwa0Kshgv37UCndRVQdrXJCpCDlLYXGGTbTIrX2ppuKeAFZjNuaARiEcMBREHWJeklvlNtH40h8mEUXwGgB0uyLjK7kFKSIs818abppTNEQvnmXYaWRd10vjSoUnBGdGNYvRfHGZ3uVIpoe55lbnrvlGrSVddmyvE7QFrZVFGz9DpEjSKmMXH0ARyoQCtY20T1oWxGMHn8Hva8STD2uEWF3QYDDTEJdKeOQX6IoySpDSoCAsu252ch2AVPZuPdVqkhtUsXdKu3u6iGslfqv1feLswlb0JY8GAygzZ667iGxN0NNIUHxvaLZPr9EmuNgTZ6QROhvQLcr4Lm5eA6uCHrdKBSnIUlINEspYMfPhH1pnR3kJJPFkf7xXnUrk3HLyCV5gPLZrcKwOLycJlIfoNUjxasNIUJRP31hGntpmE3gojCyZMjoOCciOGpcV3NpGlXMeb3cjcecLqIwdDeoR972SRk4PWilriJlJg7DyUgSTXwlWokVvMiVpJ0iaci2BFHojpfCm3fK1HaoEH62mowjVSGfvvKy3wD9qBYditlH5WjP3qxS9WGWX29FjhVFr7JWoKSbMCUMHwoYYP7F9GnXdWyIybEgUWjNOg8QspVuGi9WEIJ1KMANzD6MZRoLhuhkxNMP7KifEXVLxnbV4nn53xAHjtg2vqjMwLi4LXidgr28hnrk26Zeed1H9K3dWYbNRMpNBcpG2EMXWOqrrBRBAdh9UNjIZ059jO0128zRM1gumu0tsS2P3bRsuH3oMgLV1DxVQNOKHjUsM8WCLhkmtWCPDQvc1qEO4FBOSyBAqafkX3uZm7KiPAWncVYaDZhYSbqEvjoPXrZRZbh818qQNQ7gmWzp5CzrLYeDzxT4Bp7etNeQ11tJjkGXpVqjawbcY6nOxziadgMWUrhKeAsqBzvjcnfdyYXSsyfVqhfbu4bbo54QnSaGSncXVEHGM2KXI7vNPUl5m3zQSpb4XWqGvXjKhYhcSAkFdbee17I6uOfn2WbpNTkyfYMDAh4SL4wFNJLHpdiyBPaf7yYRMsqOwdOE5GzSaycV3eyw68P16MCpklwCSDhtHRhjbcnmFWJJxnoq9eiISohlDQcZOBsaFEoRTgbEQ7EL4FrO4TcBVKXLnNFDCfc8xGWO52Jrfev7Ve7pURa7rP5Dgjn99jMcXs3vlZyxQ2lxKinnAP5T9qhFelJZ6V89lzBQlyn4OJRwUuNCi3BqotPLIoHXGSgkmqGykImeWlmz7rr3eBsC3aCmQrb3oaaXYkxxcns5ffnCGV7TfGjNsAeUGDXXM6qJfa7ruDc30uJUBVgKVTtwkRHgYcYkmLW6mrHNNma6dPDRa7L4YaQFl1geuFC8SrfZ94J3IERz4DIh7ThlUaCqOzsrWwh9xclTDJ702a4lIud6KHm7HKHnpbpml855SUKrKvCjROI9Holp9fPvnWMpRNjbMwEuu6l57FWxh7ARtb5zFYK7qTKUp2tOYLJqO14Q7Hfr9KPE4NiEVM5ZNWHHiftkZgzSzK8mMIemEcNBaIAGqgd09NxYPOp9I8dcfPa8FdcXyqGjsmBUjpsOt61hD5IfDZY7XRivO8YDCT4grdGKJfQgYtZi3cNxEYlxz8baFU1fMocQDk038gwkSppPirDvGJNYMoJBzNFKpR4k6mxlCLwr9gUHnu8v3Fdr67DW3q9EL9ZaMVOgGRE0nGEvlkhsxbuUk3aZM8u4kzEE34GgrpXP2kkDBVDAFAqvOa9pvbUTB4lYAMQXN2e6ABaKTqrf6GpFmlsoXiSP2ycH0ogyZ7u75z9oO6jdqGGIyeNFe7M5oENjQovoRAogYMgM7pcSrOgEN5ug9bSF8WCgg2ABqbH4f6JqBNatf4Jh8XiQv3gBgwH6RuW4q7j0CBMhy4cU3xlbuRrmlVUC0Z3DoRVFlTC3skMNLnfU0lhIh7n4L6fZaBhaTrusrKoDspbnQ5k9U4HcrVEoX0mK5zgPoifiLpY6ZDaWyJrlEBX4K35X26P37owfPvRvKXThIbkDP1ErGPcTiSUNx3Xq2tZgGI9DwqBtFmdpUSqc28eRObfPuCViOwOAdq9McyHZS6KIhewPWUzypGCxpVhOFZF9gcsdaMnZt1pBgUhBNrAhBf6wcWXwPg50P0F7sYS0D6S5jwoHpJXMWx8SXMf1uuLpZiyAgj8tghDBhk4patR6j9uE1e4uJwv2yHBG27ScGNgupQcsmyJoHdVxFwxqxt2xJ29ZGL7wf32knvxiiYxe2tjaA9aooWzUU5lYWMSG8ExfOvd4HM6lV3aHc3WTx6zOuxhgR8Skfy5F3aL7M7ciX5OH46eU8hL22HTerm4U0DgI2C4xQJveLcYAopi9QQQsGjwSJ4VGPrt5QTTGKlfmDKq5S42x5ksoy2K2q3Hlksf20U3n8prfHVlVOmg5tkYwhjr1yQzX8uuVMRgVHx36rgv9HODA54dU3GHrhXKzwbRMdtDL216pf30YPRxv0yRpDC34HJdqcswlckSEz082rFcGYqKoiAZTlJHl04jrvMhQ6JrqJcMZGtv39OdrnrrgiOeCd8RjSOvDTzyqxTZNlmGheh7a4LHoh38IE1MyWOQoP26BfjIMBlsocfAOVrk0foGSuoJ70690onfR1LTFtC79bmY6KCxZSQZVh69GsFaG9bfUi5FPTuRJc8KHOJ9XcNiBpfFDRi6owB6Vv8ExOtthyChnMCWtQZVbddos9H2Q5wSAftqOjzTezNxCNMPzys6tnm7WmI0Wrw6GhXB8gqrPYeghph0HfrrBfqKm3UeKGWxuyCv5I1gqHITEGat7iogwMTN5rjQE6ehHCiyQYlaWt18XZ0zbqllWXykcfghXl74H82qyHsuhrr88axHGNwH4qwDUJj9wT6Gk9Xl1py3pvfpratAClrPRkCOd0ubtiOLMiOjpBPekAaIZ6nINo1kXBK5FsZjqZNPtta2sSZOsCGAmvlhtU0aGMkSXH0xNLEipRImKm5G3HlMYMhBXHEoN27UyTNKeBJQUs91Pkmm7VBgWxMImkJfkugIyXkReMJ6ta3H0zrvv9GMqftrqETFIg6TY6uTSaVq8WmbiKMGUpGan5UkapWDhaTj8zZvAl37fhepTm2EwXjuOgKI2CNqk284GgTB709SfNM11PdDO4PVQDvtagi8qOTaEnTkBvImjImnlkKvkumxMWOUMym8uKD6KDb2cBpbtU5X0T9VH837fir0Q62OYqeVUwvRFuBot8Y80fnbtV9YIv77ykPaySIoJTFWzjN6VedTJdee1FF8QRY1jeZtngFbqW7lAQoKtMu00NVBPVpE1wLzk7CpASw3RFzDaSX1ExAmCf1EzsvYvmZhLpyH5TAOYrDuFfWoqI44VR42TK1AFuPLPTsaZ74HxtuGDBZikZGEB2uL5E0dP8qjyhqgY5HvsG69LwLFBDgfRKC4V0ge9JuabyZyFvUOULOADAqGpfKX65JWbtLM75e0k9HL5i9Io9IOEkYYN7Q0wCwxFPCv5EIh9fXikOBrMu8VlA6Fo9eiaEjc9pVQZTQl1nWi07axsluAED0rD44xhms5XnQg5Q7ehaV2bcaL7imcaHGtNPyTD7QQNq8pyhwSPKoB3dQ8a9u7Ct0GG7hqMc7UOiUOiy8o5oW7pkCKXd4KzIzJYgmujyAheQJV8HO27NBdNiwVqMpIQhEtKciUeRKoU6z0NaEkNOBf7jnoHPZcF2OO8mMIHZlBcTNlcSJdMso3Zj1A7WyFXS0sKUwGYfaLxGNCknqZEUJcMsUYlfpJmjpqBOIvdtUOLfwZjNXwIRoUWkWEzHWSXo8VOYLokWpBoAFAFU0SVu4lN6cdqh3ktNSoHomOT6sOx4BtIDoPbmC5R49FnUWmh7BF79IMeG61EdUMJM4VJRnx6outgC5qeGl1nkSUTXs6Io3LkpbmbEz9kJFmZPcUsl0ZPeUnXzmqo9ZFoGinOndzIuAniOf7ySVv6R0RtBTK73GCqbn3GrE6Tbq7LUg91Pr2O6u9clkHGaolubz5PKvUcdrk7uj4MfiXwFe8nsbOY9lS3SLK9NaVapOfj5oUHXqtO1ynTkIPU5TfAsFJaBl6quNmI8KEaC9A8rpxYXtq4gcMu261HJpiM38gkZnWraw1LBYMnWCegaUmb8DYQKJ7gRptIt9qjzbd4Dy85tXdrU6GctogsUIbMtHNjvDefbVtcEoZFAUyBqXKPzlblMAyviP2o7iIlkqE0FyG2ECCHF8yRXzFFgYo3YFjRi6KFwN6Irb9TmmPLLujRFREEXC2fGtJ7B7b4oNiqE9u20vlHqqORopg6eWu7DozVEdl6vxBu3duJk8s8p2nrjY5HC7bvu4QaviyAeG7kn6Rir9qrvZYZaHcCB9InfczUFUiodY3ngI1kJ8pO8rsbaMKbg1gxRJcN5LTgeJk3yveGCtVNLgBN0LbxE0rmI7hbdZM3iOWc7CzprgYbZBvMilNPqgXfOQubvvg1AxaqmzZkkbCPKovxAiKlgeSEl1wixfq8AJQSQakeO66D7wgZknFgjrHZQfD10zgCnCqgHhQ7kfWtaUfrtMYdgQQgHGC1k6OlUb8IIZcAE7iwMK1I695aWpSMIgb5G3mMHDNL4lhmP3Mz1f92dQU5yBh1XRAGtQuDNYFm0KPoxCJkIupkL2dILekWxjogNMIPKpADaHOi0cNvwdMuIOQrHUUmHwQjC3mVZvnhcPXbZwBbRBrT747RxgRQlx9YnSHaqn291oFu4WWcV77jPyTWsr9aMjFrxzT6rAORr3LnKoYNSziE12Z8ztVrdGgFLK8Bn1O0LVgnJBbpf1oc7KOfQcoqyfa2xm0M6uOUfSSYBn3p0xxYXzXnRTqnNvSPP8DMonKkKpZr2ghcFuou7o7pCS7CCzyoe4rthSoLWqwH1lX46nP1rVWDjcFopl2ayDhBGFlEvHH8MkADJQvJcDtE5vitlq2QEKKW6dP2WQnm7T3AIoMHJsdnZCw0MyJB0WTvTwjXnB2cPG3T1lZi3vTv1hH8rn8gkFWeFO907ETROu5dXIQ9x2dAo3958owhXZrALU09jlB2ycw95XQRtKAFyMofogDak166VAPVHKBAW7xvvcyWt09zWsDUnUFM3BHG1A1rUuS7s4Il436VPXushnmZM465jSEMdOLbExumZL8dGqCTbz32wtNpHqozlK5cmkMfLDEQC813fJMaDik8wcIpu5hNGs9JIJEBdbcLEwLzZNxGGWG9E0OxaJ46STT8q4s4QNbIVVvBCTpftwNy6n8xQ3EpymizdJxNWnIbq8TpaPopE4tkJaV49X9B0rbz8vqYnv6DZciHFGJymIJqvSWyFIheYILWfycWjD2ZphcYFf1qzWShc27h1asaGS";
-//     int pid = create_ps(4*1024, 4*1024, 12*1024, 24*1024, p);
-//     printf("pid: %d \n", pid);
-
-//     // printf("%d\n", get_free_pcb_index());
-//     // printf("%d", NUM_FRAMES);
-//     printf("%s \n", OS_MEM + 18432*4*1024); 
-//     int fork_pid = fork_ps(pid);
-//     print_page_table(pid);
-//     exit_ps(pid);
-//     print_page_table(fork_pid); 
-//     printf("%s \n", OS_MEM + 18443*4*1024);   
-//     int pid2 = create_ps(4*1024, 4*1024, 12*1024, 24*1024, p);
-//     print_page_table(pid2); 
-// }
 
+// -------------------  benchmarks, build with -DMMU_BENCH -pthread  ------------------------------ //
+
+#ifdef MMU_BENCH
+
+// pages of a 2 MB process, the benchmarks are sized in bytes so that they run with any PAGE_SHIFT
+#define BENCH_PROC_PAGES (2 * MB / PAGE_SIZE)
+
+// fill PS_MEM one frame at a time from empty to full
+// and report the average latency of finding a free frame in every 10% of fill
+void bench_frame_alloc(){
+    os_init();
+    int buckets = 10;
+    int per_bucket = USABLE_FRAMES / buckets;
+    puts("------ frame allocation latency, empty -> full PS_MEM -------");
+    for(int b=0; b<buckets; b++){
+        int count = (b == buckets-1) ? USABLE_FRAMES - b*per_bucket : per_bucket;
+        double start = now_ns();
+        for(int i=0; i<count; i++){
+            int frame = alloc_frame();
+            assert(frame != -1);
+        }
+        double elapsed = now_ns() - start;
+        printf("fill %3d%% - %3d%% : %6.1f ns/frame\n", b*10, (b+1)*10, elapsed / count);
+    }
+    assert(alloc_frame() == -1);
+}
+
+// heap churn for the contention benchmark, every thread works on a process of its own
+#define CHURN_ITERATIONS 200000
+#define CHURN_PAGES 4
+
+void* churn_thread(void* arg){
+    int pid = *(int*)arg;
+    for(int i=0; i<CHURN_ITERATIONS; i++){
+        allocate_pages(pid, 1 * MB, CHURN_PAGES, O_READ | O_WRITE);
+        deallocate_pages(pid, 1 * MB, CHURN_PAGES);
+    }
+    magazine_flush();
+    return NULL;
+}
+
+// allocate_pages/deallocate_pages churn from 1 to 8 threads, with every request going
+// to the shared pool and with per-thread magazines in front of it
+void bench_magazine_contention(){
+    puts("------ heap allocate/free churn, million page ops/s -------");
+    puts("threads   shared pool   magazines");
+    // allocate_pages has to take the frames itself, not leave them to the first write
+    use_lazy_heap = 0;
+    for(int threads=1; threads<=8; threads*=2){
+        double rate[2];
+        for(int mode=0; mode<2; mode++){
+            os_init();
+            use_magazines = mode;
+            pthread_t tids[8];
+            int pids[8];
+            for(int t=0; t<threads; t++){
+                pids[t] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+            }
+            double start = now_ns();
+            for(int t=0; t<threads; t++){
+                pthread_create(&tids[t], NULL, churn_thread, &pids[t]);
+            }
+            for(int t=0; t<threads; t++){
+                pthread_join(tids[t], NULL);
+            }
+            double elapsed = now_ns() - start;
+            rate[mode] = 2.0 * CHURN_PAGES * CHURN_ITERATIONS * threads / elapsed * 1e3;
+            for(int t=0; t<threads; t++){
+                exit_ps(pids[t]);
+            }
+            magazine_flush();
+        }
+        printf("%7d   %11.2f   %9.2f\n", threads, rate[0], rate[1]);
+    }
+    use_magazines = 1;
+    use_lazy_heap = 1;
+}
+
+// 4 simulated CPUs, one per zone, take turns creating 2 MB processes until PS_MEM is full
+// reports how many of the frames came from the creating CPU's own zone and the cost per process
+void bench_zone_placement(){
+    puts("------ zone placement, 4 zones, 2 MB processes until PS_MEM is full -------");
+    const char* names[2] = {"local first", "interleave"};
+    int policies[2] = {ZONE_LOCAL_FIRST, ZONE_INTERLEAVE};
+    // rw_data and stack frames are allocated by create_ps itself, and code frames are not shared with
+    // processes of other CPUs through the image cache
+    use_demand_paging = 0;
+    use_image_cache = 0;
+    for(int p=0; p<2; p++){
+        num_zones = 4;
+        zone_policy = policies[p];
+        max_procs = USABLE_FRAMES / BENCH_PROC_PAGES;
+        os_init();
+        long long local = 0;
+        long long total = 0;
+        int created = 0;
+        double elapsed = 0;
+        for(int cpu=0; created<max_procs; cpu=(cpu+1)%4){
+            current_zone = cpu;
+            double start = now_ns();
+            int pid = create_ps(1 * MB, 0, 0, 1 * MB, code_ro_data);
+            elapsed += now_ns() - start;
+            if(pid == -1){
+                break;
+            }
+            created++;
+            for(int i=0; i<NUM_PAGES; i++){
+                page_table_entry pte = pte_get(pid_to_slot(pid), i);
+                if(is_present(pte)){
+                    local += zone_of_frame(pte_to_frame_num(pte)) == &buddy->zones[cpu];
+                    total++;
+                }
+            }
+        }
+        printf("%-12s: %3d processes, %5.1f%% local frames, %8.1f ns/create_ps\n",
+                names[p], created, 100.0 * local / total, elapsed / created);
+    }
+    zone_policy = ZONE_LOCAL_FIRST;
+    current_zone = 0;
+    max_procs = MAX_PROCS;
+    use_demand_paging = 1;
+    use_image_cache = 1;
+}
+
+// create_ps latency when every free frame is dirty (zeroed on the allocation path) and when the
+// pool is clean, and how fast the idle hook and the background worker zero frames
+void bench_zeroing(){
+    puts("------ pre-zeroed frames, 32 processes with 1 MB rw_data + 1 MB stack -------");
+    // fill PS_MEM with 2 MB processes and exit them so that every free frame is dirty,
+    // rw_data and stack have to get their frames in create_ps for that
+    use_demand_paging = 0;
+    max_procs = USABLE_FRAMES / BENCH_PROC_PAGES;
+    os_init();
+    static int pids[USABLE_FRAMES / BENCH_PROC_PAGES];
+    for(int i=0; i<max_procs; i++){
+        pids[i] = create_ps(0, 0, 1 * MB, 1 * MB, code_ro_data);
+    }
+    for(int i=0; i<max_procs; i++){
+        exit_ps(pids[i]);
+    }
+    magazine_flush();
+    double start = now_ns();
+    for(int i=0; i<32; i++){
+        pids[i] = create_ps(0, 0, 1 * MB, 1 * MB, code_ro_data);
+    }
+    printf("create_ps, dirty pool      : %8.1f us\n", (now_ns() - start) / 32 / 1e3);
+    for(int i=0; i<32; i++){
+        exit_ps(pids[i]);
+    }
+    magazine_flush();
+    int dirty = buddy->dirty_frames;
+    start = now_ns();
+    zero_dirty_frames(dirty);
+    double elapsed = now_ns() - start;
+    printf("zero_dirty_frames          : %8.2f GB/s\n", (double)dirty * PAGE_SIZE / elapsed);
+    start = now_ns();
+    for(int i=0; i<32; i++){
+        pids[i] = create_ps(0, 0, 1 * MB, 1 * MB, code_ro_data);
+    }
+    printf("create_ps, clean pool      : %8.1f us\n", (now_ns() - start) / 32 / 1e3);
+    start_zeroing_worker();
+    start = now_ns();
+    for(int i=0; i<32; i++){
+        exit_ps(pids[i]);
+    }
+    magazine_flush();
+    dirty = buddy->dirty_frames;
+    while(buddy->dirty_frames + buddy->zeroing_frames > 0){
+        sched_yield();
+    }
+    elapsed = now_ns() - start;
+    stop_zeroing_worker();
+    printf("exit_ps + background zero  : %8.2f GB/s\n", (double)dirty * PAGE_SIZE / elapsed);
+    max_procs = MAX_PROCS;
+    use_demand_paging = 1;
+}
+
+// create_ps/exit_ps throughput with 100, 1k and 10k small processes alive, every exit is followed by a create
+void bench_process_table(){
+    puts("------ create/exit churn with many live processes -------");
+    static int pids[10000];
+    max_procs = 16 * 1024;
+    for(int live=100; live<=10000; live*=10){
+        os_init();
+        for(int i=0; i<live; i++){
+            pids[i] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+            assert(pids[i] != -1);
+        }
+        int iterations = 20000;
+        srand(1);
+        double start = now_ns();
+        for(int i=0; i<iterations; i++){
+            int victim = rand() % live;
+            exit_ps(pids[victim]);
+            pids[victim] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+        }
+        double elapsed = now_ns() - start;
+        // liveness checks and a resident page total over the whole table, only the hot arrays are read
+        start = now_ns();
+        long live_found = 0;
+        long rss = 0;
+        for(int round=0; round<100; round++){
+            for(int i=0; i<live; i++){
+                live_found += pid_to_live_slot(pids[i]) != -1;
+            }
+            for(int i=0; i<max_procs; i++){
+                rss += proc_is_free[i] ? 0 : proc_rss[i];
+            }
+        }
+        double scan = (now_ns() - start) / 100;
+        // the code page is resident, the stack page only with eager allocation
+        assert(live_found == 100L * live && rss == 100L * (use_demand_paging ? 1 : 2) * live);
+        printf("%5d live : %8.0f create+exit/s, %8.0f ns per table scan, page table pool %d / %d in use\n",
+                live, iterations / elapsed * 1e9, scan,
+                page_table_slots->capacity - page_table_slots->free_count, page_table_slots->capacity);
+        for(int i=0; i<live; i++){
+            exit_ps(pids[i]);
+        }
+        magazine_flush();
+    }
+    max_procs = MAX_PROCS;
+}
+
+// the page table layout this is built with: page table memory and create/fork/exit cost for sparse
+// processes, and fork/exit of a densely mapped one. The layout is fixed at build time, the flat layout
+// (one NUM_PAGES entry table per process) is measured by a build with -DPT_LEAF_SHIFT='(VA_BITS - PAGE_SHIFT)'
+void bench_page_table_layout(){
+    puts("------ page table layout, 5000 processes with 3 mapped pages -------");
+    puts("layout      table bytes/ps   create+exit ns   fork+exit ns   dense fork+exit ns");
+    static int pids[5000];
+    const char* name = PT_LEAF_SHIFT == PT_LEAF_SHIFT_MAX ? "flat" : "two level";
+    max_procs = 16 * 1024;
+    os_init();
+    for(int i=0; i<5000; i++){
+        pids[i] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+        allocate_pages(pids[i], 2 * MB, 1, O_READ | O_WRITE);
+    }
+    long tables = page_table_slots->capacity - page_table_slots->free_count;
+    double table_bytes = (double)tables * PT_LEAF_SIZE / 5000 + sizeof(struct PCB);
+    int iterations = 20000;
+    double start = now_ns();
+    for(int i=0; i<iterations; i++){
+        int victim = i % 5000;
+        exit_ps(pids[victim]);
+        pids[victim] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+        allocate_pages(pids[victim], 2 * MB, 1, O_READ | O_WRITE);
+    }
+    double churn = (now_ns() - start) / iterations;
+    start = now_ns();
+    for(int i=0; i<iterations; i++){
+        exit_ps(fork_ps(pids[i % 5000]));
+    }
+    double fork = (now_ns() - start) / iterations;
+    for(int i=0; i<5000; i++){
+        exit_ps(pids[i]);
+    }
+    int dense = create_ps(1 * MB, 0, 1 * MB, 1 * MB, code_ro_data);
+    start = now_ns();
+    for(int i=0; i<200; i++){
+        exit_ps(fork_ps(dense));
+    }
+    double dense_fork = (now_ns() - start) / 200;
+    exit_ps(dense);
+    magazine_flush();
+    printf("%-9s   %14.0f   %14.0f   %12.0f   %18.0f\n", name, table_bytes, churn, fork, dense_fork);
+    max_procs = MAX_PROCS;
+}
+
+// two level tables against the hashed page table with many sparse processes:
+// page table memory, read_mem latency on random mapped pages and create/exit cost
+void bench_page_table_backends(){
+    puts("------ two level vs hashed page table, 8000 processes with 4 scattered pages -------");
+    puts("backend     table MB   read_mem ns   create+exit ns");
+    static int pids[8000];
+    int backends[2] = {PT_TWO_LEVEL, PT_HASHED};
+    const char* names[2] = {"two level", "hashed"};
+    max_procs = 16 * 1024;
+    for(int b=0; b<2; b++){
+        page_table_backend = backends[b];
+        os_init();
+        srand(1);
+        for(int i=0; i<8000; i++){
+            pids[i] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+            allocate_pages(pids[i], (1 + rand() % (NUM_PAGES / 2 - 12)) * PAGE_SIZE, 1, O_READ | O_WRITE);
+            allocate_pages(pids[i], (NUM_PAGES / 2 + rand() % (NUM_PAGES / 2 - 12)) * PAGE_SIZE, 1, O_READ | O_WRITE);
+        }
+        double bytes;
+        if(page_table_backend == PT_HASHED){
+            bytes = (double)USABLE_FRAMES * sizeof(struct hashed_pte) + (1L << hashed_bucket_bits) * sizeof(int);
+        }else{
+            bytes = (double)(page_table_slots->capacity - page_table_slots->free_count) * PT_LEAF_SIZE
+                    + 8000.0 * sizeof(struct PCB);
+        }
+        // the first and last page of a random process, both always mapped
+        int lookups = 2000000;
+        volatile unsigned char sink;
+        double start = now_ns();
+        for(int i=0; i<lookups; i++){
+            sink = read_mem(pids[rand() % 8000], (i & 1) ? 4 * MB - 1 : 0);
+        }
+        double lookup = (now_ns() - start) / lookups;
+        (void)sink;
+        int iterations = 20000;
+        start = now_ns();
+        for(int i=0; i<iterations; i++){
+            int victim = i % 8000;
+            exit_ps(pids[victim]);
+            pids[victim] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+            allocate_pages(pids[victim], (1 + rand() % (NUM_PAGES / 2 - 12)) * PAGE_SIZE, 1, O_READ | O_WRITE);
+            allocate_pages(pids[victim], (NUM_PAGES / 2 + rand() % (NUM_PAGES / 2 - 12)) * PAGE_SIZE, 1, O_READ | O_WRITE);
+        }
+        double churn = (now_ns() - start) / iterations;
+        for(int i=0; i<8000; i++){
+            exit_ps(pids[i]);
+        }
+        magazine_flush();
+        printf("%-9s   %8.2f   %11.1f   %14.0f\n", names[b], bytes / MB, lookup, churn);
+    }
+    page_table_backend = PT_TWO_LEVEL;
+    max_procs = MAX_PROCS;
+}
+
+// read_mem/write_mem with and without the TLB on three traces of one 2 MB heap process:
+// bytes in address order, a loop over 12 pages and uniformly random addresses
+void bench_tlb(){
+    printf("------ software TLB, %d sets x %d ways, 4M accesses per trace -------\n", tlb_sets, tlb_ways);
+    puts("trace          no TLB ns   TLB ns   hit rate");
+    const char* names[3] = {"sequential", "12 page loop", "random"};
+    int accesses = 4 * 1000 * 1000;
+    static int addrs[4 * 1000 * 1000];
+    for(int t=0; t<3; t++){
+        srand(1);
+        for(int i=0; i<accesses; i++){
+            // the heap starts right after the one code page
+            if(t == 0){
+                addrs[i] = PAGE_SIZE + i % (2 * MB);
+            }else if(t == 1){
+                addrs[i] = PAGE_SIZE + (i % 12) * 7 * PAGE_SIZE + i % PAGE_SIZE;
+            }else{
+                addrs[i] = PAGE_SIZE + rand() % (2 * MB);
+            }
+        }
+        double ns[2];
+        double hit_rate = 0;
+        for(int mode=0; mode<2; mode++){
+            use_tlb = mode;
+            os_init();
+            int pid = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+            allocate_pages(pid, PAGE_SIZE, BENCH_PROC_PAGES, O_READ | O_WRITE);
+            double start = now_ns();
+            for(int i=0; i<accesses; i++){
+                if(i & 1){
+                    write_mem(pid, addrs[i], (unsigned char)i);
+                }else{
+                    read_mem(pid, addrs[i]);
+                }
+            }
+            ns[mode] = (now_ns() - start) / accesses;
+            hit_rate = 100.0 * tlb_counters.hits / (tlb_counters.hits + tlb_counters.misses);
+            exit_ps(pid);
+            magazine_flush();
+        }
+        printf("%-12s   %9.1f   %6.1f   %7.2f%%\n", names[t], ns[0], ns[1], hit_rate);
+    }
+    use_tlb = 1;
+}
+
+// accesses from 64 processes interleaved one at a time, each process loops over 2 pages of its own,
+// with an untagged TLB flushed on every pid switch and with ASIDs, the last row has fewer ASIDs than processes
+void bench_tlb_asids(){
+    puts("------ interleaved pids, 64 processes x 2 pages, 4M accesses -------");
+    puts("mode                 ns/access   hit rate   evictions   rollovers     flushes");
+    const char* names[3] = {"flush on switch", "ASIDs (256)", "ASIDs (48)"};
+    int asids[3] = {256, 256, 48};
+    int pids[64];
+    int accesses = 4 * 1000 * 1000;
+    for(int mode=0; mode<3; mode++){
+        use_asids = mode > 0;
+        tlb_asids = asids[mode];
+        os_init();
+        for(int i=0; i<64; i++){
+            pids[i] = create_ps(PAGE_SIZE, 0, 4 * PAGE_SIZE, PAGE_SIZE, code_ro_data);
+        }
+        double start = now_ns();
+        for(int i=0; i<accesses; i++){
+            read_mem(pids[i % 64], (1 + (i / 64) % 2) * PAGE_SIZE + i % 1000);
+        }
+        double elapsed = (now_ns() - start) / accesses;
+        struct tlb_counters c = tlb_counters;
+        printf("%-18s   %9.1f   %7.2f%%   %9lld   %9lld   %9lld\n", names[mode], elapsed,
+                100.0 * c.hits / (c.hits + c.misses), c.evictions, c.rollovers, c.flushes);
+        for(int i=0; i<64; i++){
+            exit_ps(pids[i]);
+        }
+        magazine_flush();
+    }
+    use_asids = 1;
+    tlb_asids = 256;
+}
+
+// moving 1 MB into and out of a process byte by byte and with the range APIs
+void bench_mem_range(){
+    puts("------ 1 MB copy into / out of a process, GB/s -------");
+    puts("api                write    read");
+    os_init();
+    int pid = create_ps(PAGE_SIZE, 0, 1 * MB, PAGE_SIZE, code_ro_data);
+    static unsigned char buf[1 * MB];
+    double rate[2][2];
+    for(int mode=0; mode<2; mode++){
+        double start = now_ns();
+        if(mode == 0){
+            for(int i=0; i<1 * MB; i++){
+                write_mem(pid, PAGE_SIZE + i, buf[i]);
+            }
+        }else{
+            write_mem_range(pid, PAGE_SIZE, buf, 1 * MB);
+        }
+        rate[mode][0] = 1.0 * MB / (now_ns() - start);
+        start = now_ns();
+        if(mode == 0){
+            for(int i=0; i<1 * MB; i++){
+                buf[i] = read_mem(pid, PAGE_SIZE + i);
+            }
+        }else{
+            read_mem_range(pid, PAGE_SIZE, buf, 1 * MB);
+        }
+        rate[mode][1] = 1.0 * MB / (now_ns() - start);
+    }
+    printf("read/write_mem    %6.3f  %6.3f\n", rate[0][0], rate[0][1]);
+    printf("*_mem_range       %6.3f  %6.3f\n", rate[1][0], rate[1][1]);
+    // scanning the same 1 MB in place through pinned spans instead of copying it out first
+    struct mem_span spans[257];
+    double start = now_ns();
+    int found = 0;
+    for(int r=0; r<100; r++){
+        int n = pin_mem(pid, PAGE_SIZE, 1 * MB, O_READ, spans, 257);
+        for(int i=0; i<n; i++){
+            found += memchr(spans[i].ptr, 0xff, spans[i].len) != NULL;
+        }
+        unpin_mem(spans, n);
+    }
+    double pinned = (now_ns() - start) / 100;
+    start = now_ns();
+    for(int r=0; r<100; r++){
+        read_mem_range(pid, PAGE_SIZE, buf, 1 * MB);
+        found += memchr(buf, 0xff, 1 * MB) != NULL;
+    }
+    double copied = (now_ns() - start) / 100;
+    printf("scan 1 MB: copy out + scan %.1f us, pin_mem + scan in place %.1f us (%d)\n", copied / 1e3, pinned / 1e3, found);
+    exit_ps(pid);
+    magazine_flush();
+}
+
+// independent random byte accesses to a 2 MB heap, one read_mem/write_mem call each and in batches
+void bench_mem_batch(){
+    puts("------ 4M random byte accesses to a 2 MB heap, ns/access -------");
+    puts("api                       read    write");
+    int accesses = 4 * 1000 * 1000;
+    static int addrs[4 * 1000 * 1000];
+    static unsigned char bytes[4 * 1000 * 1000];
+    srand(1);
+    for(int i=0; i<accesses; i++){
+        addrs[i] = PAGE_SIZE + rand() % (2 * MB);
+    }
+    os_init();
+    int pid = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+    allocate_pages(pid, PAGE_SIZE, BENCH_PROC_PAGES, O_READ | O_WRITE);
+    const char* names[3] = {"read/write_mem", "*_mem_batch scalar", "*_mem_batch AVX2"};
+    for(int mode=0; mode<3; mode++){
+#ifndef __AVX2__
+        if(mode == 2){
+            puts("*_mem_batch AVX2          not built with AVX2");
+            break;
+        }
+#endif
+        use_simd = mode == 2;
+        double start = now_ns();
+        if(mode == 0){
+            for(int i=0; i<accesses; i++){
+                bytes[i] = read_mem(pid, addrs[i]);
+            }
+        }else{
+            read_mem_batch(pid, addrs, accesses, bytes);
+        }
+        double read_ns = (now_ns() - start) / accesses;
+        start = now_ns();
+        if(mode == 0){
+            for(int i=0; i<accesses; i++){
+                write_mem(pid, addrs[i], bytes[i]);
+            }
+        }else{
+            write_mem_batch(pid, addrs, bytes, accesses);
+        }
+        double write_ns = (now_ns() - start) / accesses;
+        printf("%-22s %7.1f  %7.1f\n", names[mode], read_ns, write_ns);
+    }
+    use_simd = 1;
+    exit_ps(pid);
+    magazine_flush();
+}
+
+// costs that depend on the page size, build with -DPAGE_SHIFT=14 or -DPAGE_SHIFT=16 to compare 16 KB and
+// 64 KB pages with the default 4 KB: create/fork/exit of a 2 MB process and random byte reads over 2 MB
+void bench_page_size(){
+    printf("------ %d KB pages, %d pages of virtual memory per process -------\n", PAGE_SIZE / KB, NUM_PAGES);
+    puts("create+exit ns   fork+exit ns   read_mem ns   TLB hit rate");
+    int iterations = 500;
+    int accesses = 4 * 1000 * 1000;
+    static int addrs[4 * 1000 * 1000];
+    srand(1);
+    for(int i=0; i<accesses; i++){
+        addrs[i] = PAGE_SIZE + rand() % (2 * MB);
+    }
+    os_init();
+    double start = now_ns();
+    for(int i=0; i<iterations; i++){
+        exit_ps(create_ps(PAGE_SIZE, 0, 1 * MB, 1 * MB - PAGE_SIZE, code_ro_data));
+    }
+    double create_ns = (now_ns() - start) / iterations;
+    int pid = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+    allocate_pages(pid, PAGE_SIZE, BENCH_PROC_PAGES, O_READ | O_WRITE);
+    start = now_ns();
+    for(int i=0; i<iterations; i++){
+        exit_ps(fork_ps(pid));
+    }
+    double fork_ns = (now_ns() - start) / iterations;
+    memset(&tlb_counters, 0, sizeof(tlb_counters));
+    volatile unsigned char sink = 0;
+    start = now_ns();
+    for(int i=0; i<accesses; i++){
+        sink += read_mem(pid, addrs[i]);
+    }
+    double read_ns = (now_ns() - start) / accesses;
+    printf("%13.1f   %12.1f   %11.1f   %11.2f%%\n", create_ns, fork_ns, read_ns,
+            100.0 * tlb_counters.hits / (tlb_counters.hits + tlb_counters.misses));
+    exit_ps(pid);
+    magazine_flush();
+}
+
+// frames taken by processes, free frames in the pool, the magazine and the dirty batch do not count
+long frames_in_use(){
+    return USABLE_FRAMES - buddy->free_frames - buddy->dirty_frames - buddy->zeroing_frames - magazine.count - dirty_batch.count;
+}
+
+// forking a process with a 2 MB heap with eager copies and copy on write: fork+exit latency, frames taken
+// by 32 live children and fork+exit with the child writing every page, which ends up copying it all anyway
+void bench_fork(){
+    puts("------ fork of a process with a 2 MB heap -------");
+    puts("mode          fork+exit ns   frames for 32 children   fork+write all+exit ns");
+    const char* names[2] = {"eager copy", "copy on write"};
+    int children[32];
+    int iterations = 500;
+    // the parent's heap is resident, not reserved
+    use_lazy_heap = 0;
+    for(int mode=0; mode<2; mode++){
+        use_cow_fork = mode;
+        os_init();
+        int pid = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+        allocate_pages(pid, PAGE_SIZE, BENCH_PROC_PAGES, O_READ | O_WRITE);
+        double start = now_ns();
+        for(int i=0; i<iterations; i++){
+            exit_ps(fork_ps(pid));
+        }
+        double fork_ns = (now_ns() - start) / iterations;
+        long before = frames_in_use();
+        for(int i=0; i<32; i++){
+            children[i] = fork_ps(pid);
+        }
+        long frames = frames_in_use() - before;
+        for(int i=0; i<32; i++){
+            exit_ps(children[i]);
+        }
+        start = now_ns();
+        for(int i=0; i<iterations; i++){
+            int child = fork_ps(pid);
+            for(int page=0; page<BENCH_PROC_PAGES; page++){
+                write_mem(child, (1 + page) * PAGE_SIZE, 1);
+            }
+            exit_ps(child);
+        }
+        double write_ns = (now_ns() - start) / iterations;
+        printf("%-13s %12.1f   %22ld   %22.1f\n", names[mode], fork_ns, frames, write_ns);
+        exit_ps(pid);
+        magazine_flush();
+    }
+    use_cow_fork = 1;
+    use_lazy_heap = 1;
+}
+
+// 64 processes of the same program with 1 MB of code and a 1 MB stack, like main(), with and without the
+// image cache: create_ps latency and the frames taken by all of them
+void bench_image_cache(){
+    puts("------ 64 processes from the same 1 MB code image -------");
+    puts("mode          create_ps ns   frames in use");
+    const char* names[2] = {"copy", "image cache"};
+    int pids[64];
+    for(int mode=0; mode<2; mode++){
+        use_image_cache = mode;
+        os_init();
+        long before = frames_in_use();
+        double start = now_ns();
+        for(int i=0; i<64; i++){
+            pids[i] = create_ps(1 * MB, 0, 0, 1 * MB, code_ro_data);
+        }
+        double create_ns = (now_ns() - start) / 64;
+        printf("%-13s %12.1f   %13ld\n", names[mode], create_ns, frames_in_use() - before);
+        for(int i=0; i<64; i++){
+            exit_ps(pids[i]);
+        }
+        magazine_flush();
+    }
+    use_image_cache = 1;
+}
+
+// 64 processes with 256 KB of rw_data and stack each, never written, and a 256 KB heap filled with one of
+// 4 patterns, merged by ksm_scan called with a small and a large budget until two passes are done
+// demand paging is off so that rw_data and stack get zero-filled frames of their own to merge
+void bench_ksm(){
+    puts("------ same page merging, 64 processes, zero pages + 4 heap patterns -------");
+    puts("pages/call    calls   scan ms   frames before   frames after");
+    int budgets[2] = {64, 4096};
+    int pids[64];
+    static unsigned char pattern[256 * KB];
+    use_demand_paging = 0;
+    for(int b=0; b<2; b++){
+        os_init();
+        for(int i=0; i<64; i++){
+            pids[i] = create_ps(PAGE_SIZE, 0, 256 * KB, 256 * KB, code_ro_data);
+            allocate_pages(pids[i], 1 * MB, 256 * KB / PAGE_SIZE, O_READ | O_WRITE);
+            memset(pattern, 1 + i % 4, sizeof(pattern));
+            write_mem_range(pids[i], 1 * MB, pattern, sizeof(pattern));
+        }
+        long before = frames_in_use();
+        int calls = 0;
+        while(ksm_counters.full_scans < 2){
+            ksm_scan(budgets[b]);
+            calls++;
+        }
+        printf("%10d   %6d   %7.2f   %13ld   %12ld\n", budgets[b], calls, ksm_counters.scan_ns / 1e6, before, frames_in_use());
+        if(b == 1){
+            print_ksm_stats();
+        }
+        for(int i=0; i<64; i++){
+            exit_ps(pids[i]);
+        }
+        magazine_flush();
+    }
+    use_demand_paging = 1;
+}
+
+// 64 processes with 1 MB of code, 256 KB of rw_data and a 1 MB stack, like main(), with eager allocation and
+// demand paging: create_ps latency, the frames taken by all of them and the frames once each has touched
+// its rw_data and the top 16 KB of its stack
+void bench_demand_paging(){
+    puts("------ 64 processes with a 1 MB stack, eager allocation vs demand paging -------");
+    puts("mode            create_ps ns   frames after create   frames after touch");
+    const char* names[2] = {"eager", "demand paging"};
+    int pids[64];
+    for(int mode=0; mode<2; mode++){
+        use_demand_paging = mode;
+        os_init();
+        long before = frames_in_use();
+        double start = now_ns();
+        for(int i=0; i<64; i++){
+            pids[i] = create_ps(1 * MB, 0, 256 * KB, 1 * MB, code_ro_data);
+        }
+        double create_ns = (now_ns() - start) / 64;
+        long created = frames_in_use() - before;
+        for(int i=0; i<64; i++){
+            for(int addr=1 * MB; addr<1 * MB + 256 * KB; addr+=PAGE_SIZE){
+                write_mem(pids[i], addr, 1);
+            }
+            for(int addr=PS_VIRTUAL_MEM_SIZE - 16 * KB; addr<PS_VIRTUAL_MEM_SIZE; addr+=PAGE_SIZE){
+                write_mem(pids[i], addr, 1);
+            }
+        }
+        printf("%-15s %12.1f   %19ld   %18ld\n", names[mode], create_ns, created, frames_in_use() - before);
+        for(int i=0; i<64; i++){
+            exit_ps(pids[i]);
+        }
+        magazine_flush();
+    }
+    use_demand_paging = 1;
+}
+
+// a 2 MB heap allocated eagerly and lazily by 64 processes that each write every 16th page and read the
+// rest: allocate_pages latency and the frames taken by the heaps after allocating and after the accesses
+void bench_lazy_heap(){
+    puts("------ 64 processes with a sparsely written 2 MB heap, eager vs lazy allocate_pages -------");
+    puts("mode    allocate_pages ns   frames after allocate   frames after access");
+    const char* names[2] = {"eager", "lazy"};
+    int pids[64];
+    for(int mode=0; mode<2; mode++){
+        use_lazy_heap = mode;
+        os_init();
+        for(int i=0; i<64; i++){
+            pids[i] = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+        }
+        long before = frames_in_use();
+        double start = now_ns();
+        for(int i=0; i<64; i++){
+            allocate_pages(pids[i], PAGE_SIZE, BENCH_PROC_PAGES, O_READ | O_WRITE);
+        }
+        double alloc_ns = (now_ns() - start) / 64;
+        long allocated = frames_in_use() - before;
+        for(int i=0; i<64; i++){
+            for(int page=0; page<BENCH_PROC_PAGES; page++){
+                if(page % 16 == 0){
+                    write_mem(pids[i], (1 + page) * PAGE_SIZE, 1);
+                }else{
+                    read_mem(pids[i], (1 + page) * PAGE_SIZE);
+                }
+            }
+        }
+        printf("%-7s %17.1f   %21ld   %19ld\n", names[mode], alloc_ns, allocated, frames_in_use() - before);
+        for(int i=0; i<64; i++){
+            exit_ps(pids[i]);
+        }
+        magazine_flush();
+    }
+    use_lazy_heap = 1;
+}
 
+// starting a small program from parents with 0, 512 KB and 2 MB of resident heap: fork_ps + exec_ps (copy
+// on write), vfork_ps + exec_ps and spawn_ps, each followed by exit_ps of the child
+void bench_spawn(){
+    puts("------ starting a new program from a parent, ns per child -------");
+    puts("parent heap   fork+exec   vfork+exec      spawn");
+    int heap_pages[3] = {0, BENCH_PROC_PAGES / 4, BENCH_PROC_PAGES};
+    int iterations = 2000;
+    // the parent's heap is resident, not reserved
+    use_lazy_heap = 0;
+    for(int h=0; h<3; h++){
+        os_init();
+        int pid = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+        allocate_pages(pid, PAGE_SIZE, heap_pages[h], O_READ | O_WRITE);
+        double ns[3];
+        for(int mode=0; mode<3; mode++){
+            double start = now_ns();
+            for(int i=0; i<iterations; i++){
+                int child;
+                if(mode == 2){
+                    child = spawn_ps(pid, PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data + PAGE_SIZE, NULL, 0);
+                }else{
+                    child = mode == 0 ? fork_ps(pid) : vfork_ps(pid);
+                    exec_ps(child, PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data + PAGE_SIZE);
+                }
+                exit_ps(child);
+            }
+            ns[mode] = (now_ns() - start) / iterations;
+        }
+        printf("%8d KB   %9.1f   %10.1f   %8.1f\n", heap_pages[h] * PAGE_SIZE / KB, ns[0], ns[1], ns[2]);
+        exit_ps(pid);
+        magazine_flush();
+    }
+    use_lazy_heap = 1;
+}
 
+int main(){
+    // touch all of RAM once so that first touch page faults of the host do not end up in the numbers
+    ram_init();
+    memset(RAM, 0, RAM_SIZE);
+    bench_frame_alloc();
+    bench_magazine_contention();
+    bench_zone_placement();
+    bench_zeroing();
+    bench_process_table();
+    bench_page_table_layout();
+    bench_page_table_backends();
+    bench_tlb();
+    bench_tlb_asids();
+    bench_mem_range();
+    bench_mem_batch();
+    bench_page_size();
+    bench_fork();
+    bench_image_cache();
+    bench_ksm();
+    bench_demand_paging();
+    bench_lazy_heap();
+    bench_spawn();
+}
 
+#else
 
 int main() {
 
@@ -638,8 +4154,9 @@ int main() {
 
 	int HEAP_BEGIN = 1 * MB;  // beginning of heap
 
-	// allocate 250 pages
-	allocate_pages(p2, HEAP_BEGIN, 250, O_READ | O_WRITE);
+	// allocate 1000 KB, 250 pages of 4 KB, the page counts follow PAGE_SIZE so that the heap fits
+	// between code and stack whatever the page size
+	allocate_pages(p2, HEAP_BEGIN, 1000 * KB / PAGE_SIZE, O_READ | O_WRITE);
     // printf("table ps2 \n");
     print_page_table(p2);
 
@@ -662,10 +4179,10 @@ int main() {
 
 	int ps_pids[100];
     // printf("Starting to  allocate \n");
-	// requesting 2 MB memory for 64 processes, should fill the complete 128 MB without complaining.   
+	// requesting 2 MB memory for 64 processes, 128 MB of the user RAM, should work without complaining.
 	for (int i = 0; i < 64; i++) {
     	ps_pids[i] = create_ps(1 * MB, 0, 0, 1 * MB, code_ro_data);
-    	// print_page_table(ps_pids[i]);	// should print non overlapping mappings.  
+    	// print_page_table(ps_pids[i]);	// the code pages are shared through the image cache, the rest must not overlap
 	}
     // printf("COMPLETED ALLOCATING ALL \n");
 
@@ -678,12 +4195,130 @@ int main() {
 	print_page_table(ps_pids[0]);   
 
 	// allocate 500 KB more
-	allocate_pages(ps_pids[0], 1 * MB, 125, O_READ | O_READ | O_EX);
+	allocate_pages(ps_pids[0], 1 * MB, 500 * KB / PAGE_SIZE, O_READ | O_READ | O_EX);
 
 	for (int i = 0; i < 64; i++) {
-    	print_page_table(ps_pids[i]);	// should print non overlapping mappings.  
+    	print_page_table(ps_pids[i]);	// code pages are shared through the image cache, stack and heap frames do not overlap  
+	}
+
+
+	// behaviour of fork, pids, heap recycling, KSM, ranges, batches, pins, spawn/vfork/exec and admission
+	// control, checked on a small process. Page counts stay small so that it runs with larger pages too
+	error_no = -1;
+	unsigned char page_buf[2 * PAGE_SIZE];
+	int q = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+	int q_slot = pid_to_slot(q);
+	int heap_page = HEAP_BEGIN / PAGE_SIZE;
+	allocate_pages(q, HEAP_BEGIN, 8, O_READ | O_WRITE);
+
+	// after fork_ps a write by either side stays private to it
+	write_mem(q, HEAP_BEGIN, 'a');
+	int f = fork_ps(q);
+	write_mem(f, HEAP_BEGIN, 'b');
+	write_mem(q, HEAP_BEGIN + PAGE_SIZE, 'x');
+	assert(read_mem(q, HEAP_BEGIN) == 'a' && read_mem(f, HEAP_BEGIN) == 'b');
+	assert(read_mem(f, HEAP_BEGIN + PAGE_SIZE) == 0);
+	assert(error_no == -1);
+
+	// a stale pid fails once its slot belongs to another process, which is left alone
+	exit_ps(f);
+	int g = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+	assert(pid_to_slot(g) == pid_to_slot(f) && g != f);
+	allocate_pages(g, HEAP_BEGIN, 1, O_READ | O_WRITE);
+	write_mem(g, HEAP_BEGIN, 'g');
+	read_mem(f, HEAP_BEGIN);
+	assert(error_no == ERR_SEG_FAULT);
+	error_no = -1;
+	assert(pid_to_pcb(g) != NULL && read_mem(g, HEAP_BEGIN) == 'g');
+
+	// a heap page allocated again reads as zero whatever its frame held before
+	memset(page_buf, 0xff, PAGE_SIZE);
+	write_mem_range(q, HEAP_BEGIN + 2 * PAGE_SIZE, page_buf, PAGE_SIZE);
+	deallocate_pages(q, HEAP_BEGIN + 2 * PAGE_SIZE, 1);
+	allocate_pages(q, HEAP_BEGIN + 2 * PAGE_SIZE, 1, O_READ | O_WRITE);
+	write_mem(q, HEAP_BEGIN + 2 * PAGE_SIZE, 0);
+	read_mem_range(q, HEAP_BEGIN + 2 * PAGE_SIZE, page_buf, PAGE_SIZE);
+	for (int i = 0; i < PAGE_SIZE; i++) {
+		assert(page_buf[i] == 0);
+	}
+
+	// KSM merges two identical pages into one copy on write frame, a write gives the writer its own again
+	memset(page_buf, 'k', PAGE_SIZE);
+	write_mem_range(q, HEAP_BEGIN + 3 * PAGE_SIZE, page_buf, PAGE_SIZE);
+	write_mem_range(q, HEAP_BEGIN + 4 * PAGE_SIZE, page_buf, PAGE_SIZE);
+	for (int pass = 0; pass < 3 && pte_to_frame_num(pte_get(q_slot, heap_page + 3)) !=
+	                               pte_to_frame_num(pte_get(q_slot, heap_page + 4)); pass++) {
+		ksm_scan(MAX_PROCS * NUM_PAGES);
 	}
+	assert(pte_to_frame_num(pte_get(q_slot, heap_page + 3)) == pte_to_frame_num(pte_get(q_slot, heap_page + 4)));
+	assert(pte_get(q_slot, heap_page + 3) & PTE_COW);
+	write_mem(q, HEAP_BEGIN + 3 * PAGE_SIZE, 'w');
+	assert(pte_to_frame_num(pte_get(q_slot, heap_page + 3)) != pte_to_frame_num(pte_get(q_slot, heap_page + 4)));
+	assert(read_mem(q, HEAP_BEGIN + 3 * PAGE_SIZE) == 'w' && read_mem(q, HEAP_BEGIN + 4 * PAGE_SIZE) == 'k');
+
+	// write_mem_range copies up to the first page it may not write, then kills the process
+	int h = create_ps(PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data);
+	allocate_pages(h, HEAP_BEGIN, 1, O_READ | O_WRITE);
+	assert(write_mem_range(h, HEAP_BEGIN, page_buf, 2 * PAGE_SIZE) == PAGE_SIZE);
+	assert(error_no == ERR_SEG_FAULT && pid_to_pcb(h) == NULL);
+	error_no = -1;
+
+	// translate_batch gives the same answers with and without SIMD, out of range and unmapped addresses included
+	int vaddrs[16];
+	long phys[2][16];
+	int status[2][16];
+	for (int i = 0; i < 16; i++) {
+		vaddrs[i] = i == 5 ? -1 : i == 9 ? PS_VIRTUAL_MEM_SIZE : HEAP_BEGIN + (i % 10) * PAGE_SIZE + i;
+	}
+	for (int simd = 0; simd < 2; simd++) {
+		use_simd = simd;
+		assert(translate_batch(q, vaddrs, 16, phys[simd], status[simd]) == 0);
+	}
+	use_simd = 1;
+	assert(memcmp(phys[0], phys[1], sizeof(phys[0])) == 0 && memcmp(status[0], status[1], sizeof(status[0])) == 0);
+	assert(status[0][1] == (O_READ | O_WRITE) && status[0][5] == 0 && status[0][9] == 0 && status[0][8] == 0);
+
+	// a pinned span still holds the bytes of a page deallocated since, its frame is not handed out again
+	struct mem_span span;
+	write_mem(q, HEAP_BEGIN + 5 * PAGE_SIZE, 'p');
+	assert(pin_mem(q, HEAP_BEGIN + 5 * PAGE_SIZE, PAGE_SIZE, O_READ, &span, 1) == 1);
+	deallocate_pages(q, HEAP_BEGIN + 5 * PAGE_SIZE, 1);
+	allocate_pages(q, HEAP_BEGIN + 5 * PAGE_SIZE, 1, O_READ | O_WRITE);
+	write_mem(q, HEAP_BEGIN + 5 * PAGE_SIZE, 'z');
+	assert(span.ptr[0] == 'p' && read_mem(q, HEAP_BEGIN + 5 * PAGE_SIZE) == 'z');
+	unpin_mem(&span, 1);
+
+	// spawn_ps regions are shared both ways, exec_ps of a vfork child hands the parent's memory back
+	struct mem_region shared = {HEAP_BEGIN, 1};
+	int sp = spawn_ps(q, PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data, &shared, 1);
+	write_mem(sp, HEAP_BEGIN + 5, 's');
+	write_mem(q, HEAP_BEGIN + 6, 'q');
+	assert(read_mem(q, HEAP_BEGIN + 5) == 's' && read_mem(sp, HEAP_BEGIN + 6) == 'q');
+	int v = vfork_ps(q);
+	write_mem(v, HEAP_BEGIN + 7, 'v');
+	assert(read_mem(q, HEAP_BEGIN + 7) == 'v' && proc_lent[q_slot] == 1);
+	assert(exec_ps(v, PAGE_SIZE, 0, 0, PAGE_SIZE, code_ro_data) == 0);
+	assert(proc_lent[q_slot] == 0 && error_no == -1);
+	read_mem(v, HEAP_BEGIN);
+	assert(error_no == ERR_SEG_FAULT && pid_to_pcb(v) == NULL);
+	error_no = -1;
+	assert(read_mem(q, HEAP_BEGIN + 7) == 'v');
+
+	// an allocation larger than the free memory is turned down up front and the process lives on
+	use_lazy_heap = 0;
+	while (image_cache_shrink() > 0);
+	magazine_give_back();
+	int held = pool_unreserved() - 16;
+	assert(reserve_frames(held) == 0);
+	allocate_pages(q, HEAP_BEGIN + 8 * PAGE_SIZE, 32, O_READ | O_WRITE);
+	assert(error_no == ERR_NO_MEM && pid_to_pcb(q) != NULL);
+	assert(!is_mapped(pte_get(q_slot, heap_page + 8)));
+	unreserve_frames(held);
+	use_lazy_heap = 1;
+	error_no = -1;
 
     // printf("reached the end of the test suite \n");
     // printf("%d",NUM_FRAMES-NUM_USABLE_FRAMES);
 }
+
+#endif
@@ -1,38 +1,94 @@
-#define RAM_SIZE (200 * 1024 * 1024) // 200 MB
-
-#define OS_MEM_SIZE (72 * 1024 * 1024) // 72 MB
-
-#define PAGE_SIZE (4 * 1024) // 4 KB
-
-
-// interpret each page table entry as unsigned int
-// 32 bits should be enough to store all the info
-typedef unsigned int page_table_entry;
+#include <stdint.h>
+
+// both can be overridden at build time, e.g. -DRAM_SIZE='(8L << 30)' to simulate 8 GB
+// RAM is allocated at startup and only the touched parts of it use host memory
+#ifndef RAM_SIZE
+#define RAM_SIZE (1024L * 1024 * 1024) // 1 GB
+#endif
+
+#ifndef OS_MEM_SIZE
+#define OS_MEM_SIZE (128L * 1024 * 1024) // 128 MB
+#endif
+
+// address space geometry, each can be overridden at build time too, e.g. -DPAGE_SHIFT=16 for 64 KB pages
+// everything below is derived from them, so shifts and masks fold into constants
+#ifndef PAGE_SHIFT
+#define PAGE_SHIFT 12 // 4 KB pages
+#endif
+
+#ifndef VA_BITS
+#define VA_BITS 22 // 4 MB of virtual memory per process
+#endif
+
+#ifndef PA_BITS
+#define PA_BITS 52 // largest RAM a pte can address, 4 PB
+#endif
+
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+
+
+// 64 bit page table entries
+//   bits 0-2     protection E|W|R, see enum PAGE_PROTECTIONS
+//   bit 3        present
+//   bit 4        accessed, set by read_mem and write_mem
+//   bit 5        dirty, set by write_mem
+//   bit 6        copy on write
+//   bit 7        reserved, the page is mapped with its protection bits but has no frame until first touch
+//   bit 8        shared, a spawn_ps region: fork_ps copies it for the child instead of making it copy on write
+//   bits 9-11    free for software use
+//   bits 12-63   frame number in the low PA_BITS - PAGE_SHIFT bits, the rest is free for software use
+// the page number is not stored, it is the index of the entry
+typedef uint64_t page_table_entry;
 #define PAGE_TABLE_ENTRY_SIZE sizeof(page_table_entry); 
 
-
-
-#define PS_VIRTUAL_MEM_SIZE (4 * 1024 * 1024)  // Each process has 4 MB of virtual memory
+#define PTE_PRESENT ((page_table_entry) 1 << 3)
+#define PTE_ACCESSED ((page_table_entry) 1 << 4)
+#define PTE_DIRTY ((page_table_entry) 1 << 5)
+#define PTE_COW ((page_table_entry) 1 << 6)
+#define PTE_RESERVED ((page_table_entry) 1 << 7)
+#define PTE_SHARED ((page_table_entry) 1 << 8)
+#define PTE_SOFT_SHIFT 9
+#define PTE_FRAME_SHIFT 12
+#define PTE_FRAME_BITS (PA_BITS - PAGE_SHIFT)
+#define PTE_FRAME_MASK ((((page_table_entry) 1 << PTE_FRAME_BITS) - 1) << PTE_FRAME_SHIFT)
+
+
+
+_Static_assert(PTE_FRAME_SHIFT + PTE_FRAME_BITS <= 64, "PA_BITS - PAGE_SHIFT frame bits do not fit in a pte");
+_Static_assert(RAM_SIZE <= ((page_table_entry) 1 << PA_BITS), "RAM_SIZE needs more than PA_BITS");
+
+#define PS_VIRTUAL_MEM_SIZE (1 << VA_BITS)  // Each process has 4 MB of virtual memory
+// pages of virtual memory per process
+#define NUM_PAGES (1 << (VA_BITS - PAGE_SHIFT))
+
+// two level page tables: second level tables of 1 << PT_LEAF_SHIFT entries, a page directory of
+// NUM_PAGES >> PT_LEAF_SHIFT entries in the PCB. Can be overridden at build time like the geometry above,
+// -DPT_LEAF_SHIFT='(VA_BITS - PAGE_SHIFT)' gives the old flat layout of one NUM_PAGES entry table per process
+#define PT_LEAF_SHIFT_MIN 4
+#define PT_LEAF_SHIFT_MAX (VA_BITS - PAGE_SHIFT)
+#ifndef PT_LEAF_SHIFT
+#define PT_LEAF_SHIFT (PT_LEAF_SHIFT_MAX < 5 ? PT_LEAF_SHIFT_MAX : 5)
+#endif
+_Static_assert(PT_LEAF_SHIFT_MAX >= PT_LEAF_SHIFT_MIN, "fewer than 16 pages of virtual memory");
+_Static_assert(PT_LEAF_SHIFT >= PT_LEAF_SHIFT_MIN && PT_LEAF_SHIFT <= PT_LEAF_SHIFT_MAX,
+               "PT_LEAF_SHIFT out of range");
+#define PT_DIR_ENTRIES (NUM_PAGES >> PT_LEAF_SHIFT)
 
 #define MAX_PROCS 100  // Assume that the maximum number of processes that can exist at a time is 100
                        // Total processes created may be more than 100(as some of them will exit).
-                       
+                       // This is the default, set max_procs before os_init to size the process table
+                       // for up to (1 << 16) processes.
 
 // Block for storing information of each process
+// only the cold part lives here, the hot metadata (pid, free flag, resident pages, segment bounds)
+// is kept in dense per-field arrays in OS_MEM, see proc_pid and friends in mmu.c
 struct PCB {
-    int pid;
-    int page_table_count;
-    int is_free;
-    // 32 bits for each page table entry, see page n0. 7 in paging chapter of OSTEP
-    // total number of page frames (lets include OS page frames too) is 200*1024*1024/4*1024 = 50*1024 
-    // these will be sufficiently stored in 16 bits, 2^16=64*2^10>50*2^10
-    // -> 16 bits needed to store page frame number
-    // virtual memory size is 4MB, number of pages in virtual memory is thus 1024
-    // to store page number we need 10 bits
-    // -> 10 bits needed to store page number
-    // -> 3 last bits to store page protection bit - E|W|R
-    // -> 1 bit for valid bit fourth bit from the right
-    page_table_entry page_table[1024];
+    // 64 bits for each page table entry, see page n0. 7 in paging chapter of OSTEP and the format above
+    // frame numbers count from the start of RAM (OS page frames included) and no longer fit in 16 bits
+    // virtual memory size is 4MB, number of pages in virtual memory is thus 1024 (NUM_PAGES)
+    // two level page table, each directory entry is the index of a second level table in the
+    // page table pool in OS_MEM or -1, second level tables are only allocated for mapped ranges
+    int page_dir[PT_DIR_ENTRIES];
     // TODO student: can add more fields
 };
 
@@ -47,7 +103,8 @@ enum PAGE_PROTECTIONS {
 
 
 enum ERROR {
-    ERR_SEG_FAULT
+    ERR_SEG_FAULT,
+    ERR_NO_MEM      // allocate_pages found no room for the pages, the process is left as it was
 };
 
 
@@ -62,6 +119,20 @@ void exit_ps(int pid);
 
 int fork_ps(int pid);
 
+int vfork_ps(int pid);
+
+int exec_ps(int pid, int code_size, int ro_data_size, int rw_data_size,
+            int max_stack_size, unsigned char* code_and_ro_data);
+
+// num_pages pages starting at the page boundary vmem_addr, shared by spawn_ps
+struct mem_region {
+    int vmem_addr;
+    int num_pages;
+};
+
+int spawn_ps(int pid, int code_size, int ro_data_size, int rw_data_size, int max_stack_size,
+             unsigned char* code_and_ro_data, const struct mem_region* regions, int num_regions);
+
 void allocate_pages(int pid, int vmem_addr, int num_pages, int flags);
 
 void deallocate_pages(int pid, int vmem_addr, int num_pages);
@@ -70,17 +141,69 @@ unsigned char read_mem(int pid, int vmem_addr);
 
 void write_mem(int pid, int vmem_addr, unsigned char byte);
 
+int read_mem_range(int pid, int vmem_addr, unsigned char* buf, int len);
+
+int write_mem_range(int pid, int vmem_addr, const unsigned char* buf, int len);
+
+// a run of process memory that is contiguous in RAM, handed out by pin_mem
+struct mem_span {
+    unsigned char* ptr;
+    int len;
+};
+
+int pin_mem(int pid, int vmem_addr, int len, int access, struct mem_span* spans, int max_spans);
+
+void unpin_mem(struct mem_span* spans, int num_spans);
+
+int translate_batch(int pid, const int* vaddrs, int n, long* out_phys, int* out_status);
+
+int read_mem_batch(int pid, const int* vaddrs, int n, unsigned char* out);
+
+int write_mem_batch(int pid, const int* vaddrs, const unsigned char* bytes, int n);
+
+
+
+// pte helpers are inline so that decoding folds into the callers
+
+// return the frame number from the pte
+static inline int pte_to_frame_num(page_table_entry pte) {
+    return (pte & PTE_FRAME_MASK) >> PTE_FRAME_SHIFT;
+}
 
+// return 1 if read bit is set in the pte
+// 0 otherwise
+static inline int is_readable(page_table_entry pte) {
+    return (pte & O_READ) != 0;
+}
 
-int pte_to_frame_num(page_table_entry pte);
+// return 1 if write bit is set in the pte
+// 0 otherwise
+static inline int is_writeable(page_table_entry pte) {
+    return (pte & O_WRITE) != 0;
+}
 
-int is_readable(page_table_entry pte);
+// return 1 if executable bit is set in the pte
+// 0 otherwise
+static inline int is_executable(page_table_entry pte) {
+    return (pte & O_EX) != 0;
+}
 
-int is_writeable(page_table_entry pte);
+// protection bits of the pte
+static inline int get_flags(page_table_entry pte) {
+    return pte & (O_READ | O_WRITE | O_EX);
+}
 
-int is_executable(page_table_entry pte);
+// return 1 if present bit is set in the pte
+// 0 otherwise
+static inline int is_present(page_table_entry pte) {
+    return (pte & PTE_PRESENT) != 0;
+}
 
-int is_present(page_table_entry pte);
+// return 1 if the page is mapped, that is present or reserved
+// 0 otherwise
+static inline int is_mapped(page_table_entry pte) {
+    return (pte & (PTE_PRESENT | PTE_RESERVED)) != 0;
+}
 
 
 void print_page_table(int pid);
\ No newline at end of file